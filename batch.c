@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <omp.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+
+
+/**
+ * One unit of work, a chunk of at most BATCH_CHUNK_SIZE bytes of a file.
+ */
+typedef struct {
+    size_t file;
+    off_t offset;
+    size_t len;
+} batch_task;
+
+
+/**
+ * The tasks of one worker. The owner pops from the back while idle workers
+ * steal from the front, so a thief takes the work furthest from the owner.
+ */
+typedef struct {
+    mtx_t lock;
+    batch_task *tasks;
+    size_t head, tail;
+} batch_deque;
+
+
+typedef struct {
+    bool encrypting;
+    batch_file *files;
+    batch_deque *deques;
+    int workers;
+} batch_pool;
+
+
+typedef struct {
+    batch_pool *pool;
+    int id;
+} batch_worker_arg;
+
+
+char *
+concat(const char *str, const char *suffix)
+{
+    size_t len = strlen(str), suffix_len = strlen(suffix);
+    char *out = malloc(len + suffix_len + 1);
+    if (out == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(out, str, len);
+    memcpy(out + len, suffix, suffix_len + 1);
+    return out;
+}
+
+
+/**
+ * Reports a problem with one file and marks it failed, the rest of the
+ * batch carries on.
+ */
+static void
+batch_fail(batch_file *f, const char *what)
+{
+    if (!atomic_exchange(&f->failed, true))
+        fprintf(stderr, "%s: %s\n", f->input, what);
+}
+
+
+/**
+ * Derives the output and pad names of a file given on the command line.
+ */
+static void
+batch_name(batch_file *f, bool encrypting)
+{
+    if (encrypting) {
+        f->output = concat(f->input, BATCH_CIPHER_SUFFIX);
+        f->pad = concat(f->input, BATCH_PAD_SUFFIX);
+        return;
+    }
+
+    // "x.enc" decrypts to "x" with pad "x.otp", anything else to "x.dec"
+    char *base = strip_cipher_suffix(f->input);
+    f->output = concat(base, strcmp(base, f->input) == 0 ? ".dec" : "");
+    f->pad = concat(base, BATCH_PAD_SUFFIX);
+    free(base);
+}
+
+
+/**
+ * Checks the size of \p f and creates pre-sized outputs so the chunks can
+ * be written in any order. A shared pad store is left to the caller.
+ */
+static void
+batch_prepare(batch_file *f, bool encrypting, bool keep_empty)
+{
+    struct stat st;
+    if (stat(f->input, &st) != 0 || !S_ISREG(st.st_mode)) {
+        batch_fail(f, "not a readable regular file");
+        return;
+    }
+    if (st.st_size == 0 && !keep_empty) {
+        batch_fail(f, "empty file");
+        return;
+    }
+    // a shared pad store range was laid out for the size the caller saw
+    if (f->shared_pad && f->size != st.st_size) {
+        batch_fail(f, "size does not match its range of the pad store");
+        return;
+    }
+    f->size = st.st_size;
+
+    if (!encrypting) {
+        off_t needed = f->pad_offset + f->size;
+        if (stat(f->pad, &st) != 0
+            || (f->shared_pad ? st.st_size < needed : st.st_size != needed)) {
+            batch_fail(f, "one-time-pad missing or of a different length");
+            return;
+        }
+    }
+
+    for (int i = 0; i < (encrypting && !f->shared_pad ? 2 : 1); ++i) {
+        const char *name = i == 0 ? f->output : f->pad;
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, f->size) != 0) {
+            batch_fail(f, "unable to create the output files");
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        close(fd);
+    }
+}
+
+
+/**
+ * Encrypts or decrypts a single chunk, PAD_BLOCK_SIZE bytes at a time.
+ * The pad is generated serially, the pool already keeps every core busy.
+ */
+static void
+batch_run_task(batch_pool *pool, const batch_task *task, unsigned char *data, unsigned char *pad)
+{
+    batch_file *f = &pool->files[task->file];
+    if (atomic_load(&f->failed))
+        return;
+
+    int in_fd = open(f->input, O_RDONLY);
+    int out_fd = open(f->output, O_WRONLY);
+    int pad_fd = open(f->pad, pool->encrypting ? O_WRONLY : O_RDONLY);
+
+    if (in_fd < 0 || out_fd < 0 || pad_fd < 0) {
+        batch_fail(f, strerror(errno));
+    } else {
+        for (size_t done = 0; done < task->len;) {
+            size_t len = task->len - done < PAD_BLOCK_SIZE ? task->len - done : PAD_BLOCK_SIZE;
+            off_t offset = task->offset + (off_t) done;
+
+            stat_timer t = stats_start();
+            if (!pread_full(in_fd, data, len, offset)
+                || (!pool->encrypting && !pread_full(pad_fd, pad, len, f->pad_offset + offset))) {
+                batch_fail(f, "read error");
+                break;
+            }
+            stats_stop(STAT_READ, t);
+            stats_add(STAT_BYTES, len);
+
+            if (pool->encrypting) {
+                t = stats_start();
+                if (!pad_fill(pad, len)) {
+                    fprintf(stderr, "failed to read from sysrand\n");
+                    exit(3);
+                }
+                stats_stop(STAT_PAD, t);
+            }
+
+            t = stats_start();
+            xor_buffer(data, data, pad, len);
+            stats_stop(STAT_XOR, t);
+
+            t = stats_start();
+            if (!pwrite_full(out_fd, data, len, offset)
+                || (pool->encrypting && !pwrite_full(pad_fd, pad, len, f->pad_offset + offset))) {
+                batch_fail(f, "write error");
+                break;
+            }
+            stats_stop(STAT_WRITE, t);
+
+            done += len;
+        }
+    }
+
+    if (in_fd >= 0)
+        close(in_fd);
+    if (out_fd >= 0)
+        close(out_fd);
+    if (pad_fd >= 0)
+        close(pad_fd);
+}
+
+
+/**
+ * Takes the next task for worker \p id: its own newest task, or else the
+ * oldest task of the first other worker that still has one.
+ * @returns false once every deque is empty, no tasks are added after the start.
+ */
+static bool
+batch_next_task(batch_pool *pool, int id, batch_task *task)
+{
+    for (int i = 0; i < pool->workers; ++i) {
+        batch_deque *d = &pool->deques[(id + i) % pool->workers];
+        bool found = false;
+
+        mtx_lock(&d->lock);
+        if (d->head < d->tail) {
+            *task = i == 0 ? d->tasks[--d->tail] : d->tasks[d->head++];
+            found = true;
+        }
+        mtx_unlock(&d->lock);
+
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+
+static int
+batch_worker(void *arg)
+{
+    batch_worker_arg *a = arg;
+    unsigned char *data = aligned_alloc(PAD_ALIGNMENT, PAD_BLOCK_SIZE);
+    unsigned char *pad = aligned_alloc(PAD_ALIGNMENT, PAD_BLOCK_SIZE);
+    if (data == NULL || pad == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    batch_task task;
+    while (batch_next_task(a->pool, a->id, &task))
+        batch_run_task(a->pool, &task, data, pad);
+
+    free(data);
+    free(pad);
+    return 0;
+}
+
+
+char *
+strip_cipher_suffix(const char *name)
+{
+    char *base = concat(name, "");
+    size_t len = strlen(base), suffix_len = strlen(BATCH_CIPHER_SUFFIX);
+    if (len > suffix_len && strcmp(base + len - suffix_len, BATCH_CIPHER_SUFFIX) == 0)
+        base[len - suffix_len] = '\0';
+    return base;
+}
+
+
+size_t
+batch_execute(bool encrypting, bool keep_empty, batch_file *files, size_t count)
+{
+    batch_pool pool = {
+        .encrypting = encrypting,
+        .files = files,
+        .workers = omp_get_max_threads(),
+    };
+    pool.deques = calloc((size_t) pool.workers, sizeof(batch_deque));
+    if (pool.deques == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // checking sizes and creating outputs is mostly metadata I/O, so overlap it too
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (size_t i = 0; i < count; ++i)
+        batch_prepare(&files[i], encrypting, keep_empty);
+
+    // split every file into chunks, dealing them out round-robin
+    size_t n_tasks = 0;
+    for (size_t i = 0; i < count; ++i)
+        if (!atomic_load(&pool.files[i].failed))
+            n_tasks += (size_t) ((pool.files[i].size + (off_t) BATCH_CHUNK_SIZE - 1)
+                                 / (off_t) BATCH_CHUNK_SIZE);
+
+    size_t per_worker = n_tasks / (size_t) pool.workers + 1;
+    for (int w = 0; w < pool.workers; ++w) {
+        pool.deques[w].tasks = malloc(per_worker * sizeof(batch_task));
+        if (pool.deques[w].tasks == NULL || mtx_init(&pool.deques[w].lock, mtx_plain) != thrd_success) {
+            fprintf(stderr, "fatal: unable to set up the batch workers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t next = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (atomic_load(&pool.files[i].failed))
+            continue;
+
+        for (off_t offset = 0; offset < pool.files[i].size; offset += (off_t) BATCH_CHUNK_SIZE) {
+            batch_deque *d = &pool.deques[next++ % (size_t) pool.workers];
+            off_t remain = pool.files[i].size - offset;
+            d->tasks[d->tail++] = (batch_task) {
+                .file = i, .offset = offset,
+                .len = remain < (off_t) BATCH_CHUNK_SIZE ? (size_t) remain : BATCH_CHUNK_SIZE,
+            };
+        }
+    }
+
+    thrd_t *threads = malloc((size_t) pool.workers * sizeof(thrd_t));
+    batch_worker_arg *args = malloc((size_t) pool.workers * sizeof(batch_worker_arg));
+    if (threads == NULL || args == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int w = 0; w < pool.workers; ++w) {
+        args[w] = (batch_worker_arg) {.pool = &pool, .id = w};
+        if (thrd_create(&threads[w], batch_worker, &args[w]) != thrd_success) {
+            fprintf(stderr, "fatal: unable to start the batch workers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int w = 0; w < pool.workers; ++w)
+        thrd_join(threads[w], NULL);
+
+    size_t failures = 0;
+    for (size_t i = 0; i < count; ++i)
+        failures += atomic_load(&pool.files[i].failed);
+    for (int w = 0; w < pool.workers; ++w) {
+        mtx_destroy(&pool.deques[w].lock);
+        free(pool.deques[w].tasks);
+    }
+    free(threads);
+    free(args);
+    free(pool.deques);
+    return failures;
+}
+
+
+size_t
+batch_run(bool encrypting, char *const files[], size_t count)
+{
+    batch_file *batch = calloc(count ? count : 1, sizeof(batch_file));
+    if (batch == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        batch[i].input = files[i];
+        atomic_init(&batch[i].failed, false);
+        batch_name(&batch[i], encrypting);
+    }
+
+    size_t failures = batch_execute(encrypting, false, batch, count);
+
+    for (size_t i = 0; i < count; ++i) {
+        free(batch[i].output);
+        free(batch[i].pad);
+    }
+    free(batch);
+    return failures;
+}
+
+
+char **
+batch_read_manifest(const char *name, char **files, size_t *count)
+{
+    FILE *fp = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open manifest \"%s\"\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        files = realloc(files, (*count + 1) * sizeof(char *));
+        if (files == NULL) {
+            fprintf(stderr, "fatal: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        files[(*count)++] = concat(line, "");
+    }
+
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    return files;
+}
@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <immintrin.h>
+#include <x86intrin.h>
+#include <omp.h>
+
+#include "otp.h"
+
+#define BENCH_MIN_BYTES ((size_t) 256 << 20)    // minimum bytes processed per measurement
+#define BENCH_MAX_REPS 1000
+#define BENCH_XOR_HOT ((size_t) 256 << 10)      // fits in L2
+#define BENCH_XOR_COLD ((size_t) 64 << 20)      // streams from memory
+
+
+/**
+ * Wall-clock and TSC readings taken together.
+ */
+typedef struct {
+    struct timespec ts;
+    unsigned long long tsc;
+} bench_clock;
+
+
+static bench_clock
+bench_now(void)
+{
+    bench_clock c;
+    clock_gettime(CLOCK_MONOTONIC, &c.ts);
+    c.tsc = __rdtsc();
+    return c;
+}
+
+
+/**
+ * Prints one result row with the throughput in MB/s and the reference (TSC)
+ * cycles per byte.
+ */
+static void
+bench_report(const char *label, size_t bytes, bench_clock start, bench_clock end)
+{
+    double seconds = (double) (end.ts.tv_sec - start.ts.tv_sec)
+                     + (double) (end.ts.tv_nsec - start.ts.tv_nsec) / 1e9;
+    printf("  %-28s %12.1f MB/s %10.3f cycles/byte\n", label,
+           (double) bytes / seconds / 1e6, (double) (end.tsc - start.tsc) / (double) bytes);
+}
+
+
+/**
+ * Measures the generation rate of \p fill for 1, 2, 4, ... threads.
+ */
+static void
+bench_generator(const char *name, bool (*fill)(unsigned char *, size_t), size_t total)
+{
+    printf("%s generation\n", name);
+
+    int max_threads = omp_get_max_threads();
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads)
+            threads = max_threads;
+
+        size_t per_thread = total / (size_t) threads;
+        int failed = 0;
+        bench_clock start = bench_now();
+
+        #pragma omp parallel num_threads(threads) reduction(|:failed)
+        {
+            unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, PAD_BLOCK_SIZE);
+            for (size_t done = 0; buf != NULL && done < per_thread; done += PAD_BLOCK_SIZE)
+                if (!fill(buf, PAD_BLOCK_SIZE))
+                    failed = 1;
+            failed |= buf == NULL;
+            free(buf);
+        }
+
+        bench_clock end = bench_now();
+        char label[64];
+        snprintf(label, sizeof(label), "%d thread%s%s", threads, threads == 1 ? "" : "s",
+                 failed ? " (failures)" : "");
+        bench_report(label, per_thread * (size_t) threads, start, end);
+
+        if (threads == max_threads)
+            break;
+    }
+}
+
+
+/**
+ * Measures every XOR kernel the CPU supports on a cache-resident and a
+ * memory-bound working set.
+ */
+static void
+bench_xor(void)
+{
+    printf("XOR kernels\n");
+
+    unsigned char *dst = aligned_alloc(PAD_ALIGNMENT, BENCH_XOR_COLD);
+    unsigned char *a = aligned_alloc(PAD_ALIGNMENT, BENCH_XOR_COLD);
+    unsigned char *b = aligned_alloc(PAD_ALIGNMENT, BENCH_XOR_COLD);
+    if (dst == NULL || a == NULL || b == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the XOR buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(a, 0x5a, BENCH_XOR_COLD);
+    memset(b, 0xa5, BENCH_XOR_COLD);
+    memset(dst, 0, BENCH_XOR_COLD);
+
+    size_t sizes[] = {BENCH_XOR_HOT, BENCH_XOR_COLD};
+    for (size_t k = 0; k < xor_kernel_count; ++k) {
+        if (xor_kernels[k].supported != NULL && !xor_kernels[k].supported())
+            continue;
+
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            size_t reps = BENCH_MIN_BYTES * 4 / sizes[s];
+            bench_clock start = bench_now();
+            for (size_t r = 0; r < reps; ++r)
+                xor_kernels[k].fn(dst, a, b, sizes[s]);
+            bench_clock end = bench_now();
+
+            char label[64];
+            snprintf(label, sizeof(label), "%s %zu KiB", xor_kernels[k].name, sizes[s] >> 10);
+            bench_report(label, sizes[s] * reps, start, end);
+        }
+    }
+
+    free(dst);
+    free(a);
+    free(b);
+}
+
+
+/**
+ * Measures the selected CRC32C implementation on a cache-resident and a
+ * memory-bound working set.
+ */
+static void
+bench_crc32c(void)
+{
+    printf("CRC32C (%s)\n", crc32c_init());
+
+    unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, BENCH_XOR_COLD);
+    if (buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the CRC32C buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 0x5a, BENCH_XOR_COLD);
+
+    size_t sizes[] = {BENCH_XOR_HOT, BENCH_XOR_COLD};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t reps = BENCH_MIN_BYTES * 4 / sizes[s];
+        volatile uint32_t crc = 0;
+        bench_clock start = bench_now();
+        for (size_t r = 0; r < reps; ++r)
+            crc = crc32c(crc, buf, sizes[s]);
+        bench_clock end = bench_now();
+
+        char label[64];
+        snprintf(label, sizeof(label), "%zu KiB", sizes[s] >> 10);
+        bench_report(label, sizes[s] * reps, start, end);
+    }
+
+    free(buf);
+}
+
+
+/**
+ * Measures the Wegman-Carter MAC on the same working sets as CRC32C, its
+ * cost is what --auth adds on top of the XOR.
+ */
+static void
+bench_mac(void)
+{
+    unsigned char key[MAC_KEY_SIZE], tag[MAC_TAG_SIZE];
+    memset(key, 0xa5, sizeof(key));
+    otp_mac mac;
+    mac_init(&mac, key);
+    printf("MAC (%s)\n", mac.pclmul ? "pclmul" : "software");
+
+    unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, BENCH_XOR_COLD);
+    if (buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the MAC buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 0x5a, BENCH_XOR_COLD);
+
+    size_t sizes[] = {BENCH_XOR_HOT, BENCH_XOR_COLD};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t reps = BENCH_MIN_BYTES * 4 / sizes[s];
+        bench_clock start = bench_now();
+        for (size_t r = 0; r < reps; ++r)
+            mac_update(&mac, buf, sizes[s]);
+        bench_clock end = bench_now();
+
+        char label[64];
+        snprintf(label, sizeof(label), "%zu KiB", sizes[s] >> 10);
+        bench_report(label, sizes[s] * reps, start, end);
+    }
+
+    mac_final(&mac, tag);
+    free(buf);
+}
+
+
+/**
+ * Measures the health tests pad_fill() runs on every buffer it generates.
+ */
+static void
+bench_health(void)
+{
+    printf("health tests (%s)\n", health_init());
+    unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, BENCH_XOR_COLD);
+    if (buf == NULL || !pad_fill(buf, BENCH_XOR_COLD)) {
+        fprintf(stderr, "fatal: unable to fill the health test buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t sizes[] = {BENCH_XOR_HOT, BENCH_XOR_COLD};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        // the same buffer again would fail the repetition count test
+        size_t reps = BENCH_MIN_BYTES * 4 / sizes[s];
+        bench_clock start = bench_now();
+        for (size_t r = 0; r < reps; ++r) {
+            buf[0] ^= 1;
+            if (health_test(buf, sizes[s]) != NULL) {
+                fprintf(stderr, "fatal: the benchmark pad failed its health test\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        bench_clock end = bench_now();
+
+        char label[64];
+        snprintf(label, sizeof(label), "%zu KiB", sizes[s] >> 10);
+        bench_report(label, sizes[s] * reps, start, end);
+    }
+
+    free(buf);
+}
+
+
+/**
+ * Opens \p name or exits.
+ */
+static FILE *
+bench_open(const char *name, const char *mode)
+{
+    FILE *fp = fopen(name, mode);
+    if (fp == NULL) {
+        fprintf(stderr, "fatal: unable to open \"%s\"\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+
+/**
+ * Writes a plain text file of \p size bytes. The content does not matter to
+ * the throughput, so it is a cheap pattern rather than random data.
+ */
+static void
+bench_make_plain(const char *name, size_t size)
+{
+    FILE *fp = bench_open(name, "wb");
+    unsigned char *buf = malloc(PAD_BLOCK_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the plain text buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 'A', PAD_BLOCK_SIZE);
+
+    for (size_t done = 0; done < size;) {
+        size_t n = size - done < PAD_BLOCK_SIZE ? size - done : PAD_BLOCK_SIZE;
+        if (fwrite(buf, 1, n, fp) != n) {
+            fprintf(stderr, "fatal: unable to write \"%s\"\n", name);
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+
+    free(buf);
+    fclose(fp);
+}
+
+
+typedef enum {
+    E2E_ENCRYPT, E2E_ENCRYPT_URING, E2E_DECRYPT, E2E_DECRYPT_MMAP, E2E_DECRYPT_URING,
+    E2E_DECRYPT_PARALLEL, E2E_COUNT
+} E_E2E_VARIANT;
+
+static const char *const e2e_names[E2E_COUNT] = {
+    "encrypt", "encrypt io_uring", "decrypt", "decrypt mmap", "decrypt io_uring",
+    "decrypt parallel"
+};
+
+
+/**
+ * Runs one end-to-end encryption or decryption over the benchmark files.
+ */
+static void
+bench_run_e2e(E_E2E_VARIANT variant, const char *plain, const char *cipher,
+              const char *pad, const char *out)
+{
+    bool encrypting = variant == E2E_ENCRYPT || variant == E2E_ENCRYPT_URING;
+    FILE *in = bench_open(encrypting ? plain : cipher, "rb");
+    FILE *otp = bench_open(pad, encrypting ? "wb" : "rb");
+    FILE *output = bench_open(encrypting ? cipher : out,
+                              variant == E2E_DECRYPT_MMAP ? "w+b" : "wb");
+
+    switch (variant) {
+        case E2E_ENCRYPT:
+            encrypt(in, output, otp);
+            break;
+        case E2E_ENCRYPT_URING:
+            if (!encrypt_uring(in, output, otp))
+                encrypt(in, output, otp);
+            break;
+        case E2E_DECRYPT:
+            decrypt(in, output, otp);
+            break;
+        case E2E_DECRYPT_MMAP:
+            decrypt_mmap(in, output, otp);
+            break;
+        case E2E_DECRYPT_URING:
+            if (!decrypt_uring(in, output, otp))
+                decrypt(in, output, otp);
+            break;
+        case E2E_DECRYPT_PARALLEL:
+            if (!decrypt_parallel(in, output, otp))
+                decrypt(in, output, otp);
+            break;
+        default:
+            break;
+    }
+
+    fclose(in);
+    fclose(otp);
+    fclose(output);
+}
+
+
+/**
+ * Measures encrypt() and decrypt() and their alternative backends for file
+ * sizes from 1 KiB to \p max_size, growing by 8x per step.
+ */
+static void
+bench_end_to_end(const char *dir, size_t max_size)
+{
+    char plain[4096], cipher[4096], pad[4096], out[4096];
+    snprintf(plain, sizeof(plain), "%s/bench_plain.bin", dir);
+    snprintf(cipher, sizeof(cipher), "%s/bench_cipher.bin", dir);
+    snprintf(pad, sizeof(pad), "%s/bench_pad.otp", dir);
+    snprintf(out, sizeof(out), "%s/bench_out.bin", dir);
+
+    printf("end-to-end (files in %s, page cache warm)\n", dir);
+
+    for (size_t size = 1024;; size *= 8) {
+        if (size > max_size)
+            size = max_size;
+
+        bench_make_plain(plain, size);
+
+        size_t reps = BENCH_MIN_BYTES / size;
+        if (reps < 1)
+            reps = 1;
+        if (reps > BENCH_MAX_REPS)
+            reps = BENCH_MAX_REPS;
+
+        for (int v = 0; v < E2E_COUNT; ++v) {
+            bench_clock start = bench_now();
+            for (size_t r = 0; r < reps; ++r)
+                bench_run_e2e((E_E2E_VARIANT) v, plain, cipher, pad, out);
+            bench_clock end = bench_now();
+
+            char label[64];
+            snprintf(label, sizeof(label), "%s %zu KiB", e2e_names[v], size >> 10);
+            bench_report(label, size * reps, start, end);
+        }
+
+        if (size == max_size)
+            break;
+    }
+
+    remove(plain);
+    remove(cipher);
+    remove(pad);
+    remove(out);
+}
+
+
+/**
+ * Throughput benchmarks for every stage of the pipeline.
+ * Program arguments:
+ * - --max-size N Largest end-to-end file size, with an optional K/M/G suffix (default 1G)
+ * - --dir DIR Directory for the end-to-end files (default the working directory)
+ * - --threads N Threads used by the pad generation (defaults to the OpenMP default)
+ *
+ * cycles/byte are TSC reference cycles of wall-clock time, not core cycles.
+ */
+int main(int argc, char* argv[argc]) {
+    size_t max_size = (size_t) 1 << 30;
+    const char *dir = ".";
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+            max_size = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            int threads = atoi(argv[++i]);
+            if (threads <= 0) {
+                fprintf(stderr, "Invalid thread count \"%s\"\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            omp_set_num_threads(threads);
+        } else {
+            fprintf(stderr, "usage: %s [--max-size N[K|M|G]] [--dir DIR] [--threads N]\n", argv[0]);
+            exit(2);
+        }
+    }
+
+    printf("selected XOR kernel: %s\n", xor_init());
+    printf("selected pad engine: %s\n", pad_engine_init());
+
+    // rdseed is far slower than the others, it gets a smaller budget
+    for (int e = 0; e < PAD_ENGINE_COUNT; ++e)
+        if (pad_engines[e].supported == NULL || pad_engines[e].supported())
+            bench_generator(pad_engines[e].name, pad_engines[e].fill,
+                            e == PAD_ENGINE_RDSEED ? BENCH_MIN_BYTES / 16 : BENCH_MIN_BYTES);
+    bench_xor();
+    bench_crc32c();
+    bench_mac();
+    bench_health();
+    bench_end_to_end(dir, max_size);
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+
+#define CHECKPOINT_MAGIC "OTPCKPT1"
+#define CHECKPOINT_VERSION 1
+
+
+/**
+ * The start of a state file, followed by \p count checkpoint_interval entries.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t check;             // CRC32C of the header with check set to 0 and the entries
+    uint64_t plain_size;
+    int64_t plain_mtime_sec;
+    int64_t plain_mtime_nsec;
+    uint64_t offset;
+    uint64_t pad_offset;
+    uint64_t count;
+} checkpoint_file;
+
+
+static uint32_t
+checkpoint_check(checkpoint_file *h, const checkpoint_interval *intervals)
+{
+    uint32_t check = h->check;
+    h->check = 0;
+    uint32_t crc = crc32c(0, (const unsigned char *) h, sizeof(*h));
+    crc = crc32c(crc, (const unsigned char *) intervals, h->count * sizeof(checkpoint_interval));
+    h->check = check;
+    return crc;
+}
+
+
+bool
+checkpoint_read(const char *path, checkpoint *c)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return false;
+        fprintf(stderr, "Unable to open the checkpoint \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // the file is replaced by rename(), so anything but a whole one is corruption
+    checkpoint_file h;
+    bool valid = pread_full(fd, (unsigned char *) &h, sizeof(h), 0)
+                 && memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) == 0
+                 && h.version == CHECKPOINT_VERSION && h.count <= h.plain_size;
+    c->intervals = valid ? malloc((h.count + 1) * sizeof(checkpoint_interval)) : NULL;
+    if (!valid || c->intervals == NULL
+        || !pread_full(fd, (unsigned char *) c->intervals, h.count * sizeof(checkpoint_interval),
+                       sizeof(h))
+        || h.check != checkpoint_check(&h, c->intervals)) {
+        fprintf(stderr, "fatal: the checkpoint \"%s\" is corrupt\n", path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    c->plain_size = h.plain_size;
+    c->plain_mtime_sec = h.plain_mtime_sec;
+    c->plain_mtime_nsec = h.plain_mtime_nsec;
+    c->offset = h.offset;
+    c->pad_offset = h.pad_offset;
+    c->count = (size_t) h.count;
+    return true;
+}
+
+
+void
+checkpoint_write(const char *path, const checkpoint *c)
+{
+    checkpoint_file h = {
+        .magic = CHECKPOINT_MAGIC, .version = CHECKPOINT_VERSION,
+        .plain_size = c->plain_size, .plain_mtime_sec = c->plain_mtime_sec,
+        .plain_mtime_nsec = c->plain_mtime_nsec, .offset = c->offset,
+        .pad_offset = c->pad_offset, .count = c->count,
+    };
+    h.check = checkpoint_check(&h, c->intervals);
+
+    // the old checkpoint stays in place until the new one is complete
+    char *tmp = concat(path, ".tmp");
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || !pwrite_full(fd, (const unsigned char *) &h, sizeof(h), 0)
+        || !pwrite_full(fd, (const unsigned char *) c->intervals,
+                        c->count * sizeof(checkpoint_interval), sizeof(h))
+        || fsync(fd) != 0) {
+        fprintf(stderr, "fatal: unable to write the checkpoint \"%s\"\n", tmp);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "fatal: unable to replace the checkpoint \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+    sync_parent(path);
+    free(tmp);
+}
@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+
+#define CONTAINER_MAX_CHUNK ((uint32_t) 64 << 20)  // largest chunk_size accepted when reading
+
+
+noreturn static void
+container_corrupt(const char *what)
+{
+    fprintf(stderr, "fatal: corrupt cipher text container, %s\n", what);
+    exit(3);
+}
+
+
+/**
+ * Reads and checks the header of a container against the pad store it is
+ * decrypted with, a version 1 header is filled up with an empty table.
+ */
+static void
+container_read_header(FILE *cipher_text, cipher_header *h,
+                      const unsigned char pad_id[PAD_ID_SIZE], uint64_t pad_size)
+{
+    memset(h, 0, sizeof(*h));
+    if (fread(h, CIPHER_HEADER_V1_SIZE, 1, cipher_text) != 1
+        || memcmp(h->magic, CIPHER_MAGIC, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "fatal: the cipher text has no header, it was not encrypted with a pad store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (h->version == 1 && h->header_size == CIPHER_HEADER_V1_SIZE) {
+        h->chunk_size = 0;
+    } else if ((h->version == 2 || h->version == CIPHER_VERSION) && h->header_size == sizeof(*h)) {
+        if (fread((unsigned char *) h + CIPHER_HEADER_V1_SIZE,
+                  sizeof(*h) - CIPHER_HEADER_V1_SIZE, 1, cipher_text) != 1)
+            container_corrupt("the header is cut short");
+        if (h->chunk_size == 0 || h->chunk_size > CONTAINER_MAX_CHUNK
+            || h->entry_size != (h->version == 2 ? CHUNK_ENTRY_V2_SIZE : sizeof(chunk_entry))
+            || h->chunk_count != (h->length + h->chunk_size - 1) / h->chunk_size)
+            container_corrupt("the chunk table does not fit the header");
+    } else {
+        fprintf(stderr, "fatal: unsupported cipher text version %u\n", (unsigned) h->version);
+        exit(EXIT_FAILURE);
+    }
+
+    if (memcmp(h->pad_id, pad_id, PAD_ID_SIZE) != 0) {
+        fprintf(stderr, "fatal: the cipher text was encrypted with a different pad store\n");
+        exit(EXIT_FAILURE);
+    }
+    if (h->pad_offset + h->length > pad_size || h->pad_offset + h->length < h->pad_offset)
+        size_missmatch();
+}
+
+
+/**
+ * The entry chunk \p i of a container has to have, the pad range is
+ * contiguous so the table can be checked without trusting it.
+ */
+static chunk_entry
+container_expected_entry(const cipher_header *h, uint64_t i)
+{
+    uint64_t offset = i * h->chunk_size;
+    uint64_t remain = h->length - offset;
+    return (chunk_entry) {
+        .offset = offset, .pad_offset = h->pad_offset + offset,
+        .length = (uint32_t) (remain < h->chunk_size ? remain : h->chunk_size),
+    };
+}
+
+
+/**
+ * Reads \p count table entries starting with entry \p first, widening older
+ * entries without checksums.
+ */
+static void
+container_read_table(int fd, const cipher_header *h, uint64_t first, size_t count, chunk_entry *entries)
+{
+    unsigned char *raw = malloc(count * h->entry_size);
+    if (raw == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!pread_full(fd, raw, count * h->entry_size,
+                    (off_t) (h->header_size + h->length + first * h->entry_size)))
+        container_corrupt("the chunk table is cut short");
+
+    for (size_t i = 0; i < count; ++i) {
+        memset(&entries[i], 0, sizeof(chunk_entry));
+        memcpy(&entries[i], raw + i * h->entry_size, h->entry_size);
+    }
+    free(raw);
+}
+
+
+static uint32_t
+container_crc(const unsigned char *buf, size_t len)
+{
+    stat_timer t = stats_start();
+    uint32_t crc = crc32c(0, buf, len);
+    stats_stop(STAT_CRC, t);
+    return crc;
+}
+
+
+/**
+ * Fails if chunk \p i does not have the checksums its table entry lists.
+ */
+static void
+container_check_chunk(const chunk_entry *e, uint64_t i, uint32_t cipher_crc, uint32_t pad_crc)
+{
+    if (e->cipher_crc != cipher_crc) {
+        fprintf(stderr, "fatal: chunk %llu of the cipher text fails its CRC32C, the cipher text is corrupt\n",
+                (unsigned long long) i);
+        exit(3);
+    }
+    if (e->pad_crc != pad_crc) {
+        fprintf(stderr, "fatal: chunk %llu of the pad fails its CRC32C, the pad store is corrupt\n",
+                (unsigned long long) i);
+        exit(3);
+    }
+}
+
+
+static void
+container_read_pad(unsigned char *pad, int pad_fd, uint64_t pad_offset, size_t len)
+{
+    stat_timer t = stats_start();
+    if (!pread_full(pad_fd, pad, len, (off_t) (PAD_STORE_DATA_OFFSET + pad_offset))) {
+        fprintf(stderr, "fatal: the pad store ended early\n");
+        exit(EXIT_FAILURE);
+    }
+    stats_stop(STAT_READ, t);
+    stats_add(STAT_BYTES, len);
+}
+
+
+static void
+container_xor(unsigned char *data, const unsigned char *pad, size_t len)
+{
+    stat_timer t = stats_start();
+    xor_buffer(data, data, pad, len);
+    stats_stop(STAT_XOR, t);
+}
+
+
+static void
+container_write(FILE *output, const void *buf, size_t len)
+{
+    stat_timer t = stats_start();
+    if (fwrite(buf, sizeof(char), len, output) != len) {
+        fprintf(stderr, "fatal: write error\n");
+        exit(EXIT_FAILURE);
+    }
+    stats_stop(STAT_WRITE, t);
+}
+
+
+static void
+container_alloc(size_t len, unsigned char **data, unsigned char **pad)
+{
+    *data = aligned_alloc(PAD_ALIGNMENT, len);
+    *pad = aligned_alloc(PAD_ALIGNMENT, len);
+    if (*data == NULL || *pad == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void
+container_encrypt(FILE *plain_text, FILE *output, int pad_fd,
+                  const unsigned char pad_id[PAD_ID_SIZE], uint64_t pad_offset, uint64_t length)
+{
+    cipher_header h = {
+        .magic = CIPHER_MAGIC, .version = CIPHER_VERSION, .header_size = sizeof(cipher_header),
+        .pad_offset = pad_offset, .length = length,
+        .chunk_size = CONTAINER_CHUNK_SIZE, .entry_size = sizeof(chunk_entry),
+        .chunk_count = (length + CONTAINER_CHUNK_SIZE - 1) / CONTAINER_CHUNK_SIZE,
+    };
+    memcpy(h.pad_id, pad_id, PAD_ID_SIZE);
+
+    chunk_entry *table = calloc(h.chunk_count ? h.chunk_count : 1, sizeof(chunk_entry));
+    unsigned char *data, *pad;
+    container_alloc(h.chunk_size, &data, &pad);
+    if (table == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    container_write(output, &h, sizeof(h));
+    for (uint64_t i = 0; i < h.chunk_count; ++i) {
+        chunk_entry *e = &table[i];
+        *e = container_expected_entry(&h, i);
+
+        stat_timer t = stats_start();
+        if (fread(data, sizeof(char), e->length, plain_text) != e->length) {
+            fprintf(stderr, "fatal: the plain text shrank during encryption\n");
+            exit(EXIT_FAILURE);
+        }
+        stats_stop(STAT_READ, t);
+
+        container_read_pad(pad, pad_fd, e->pad_offset, e->length);
+        container_xor(data, pad, e->length);
+        e->cipher_crc = container_crc(data, e->length);
+        e->pad_crc = container_crc(pad, e->length);
+        container_write(output, data, e->length);
+    }
+    container_write(output, table, h.chunk_count * sizeof(chunk_entry));
+
+    free(table);
+    free(data);
+    free(pad);
+}
+
+
+void
+container_decrypt(FILE *cipher_text, FILE *output, int pad_fd,
+                  const unsigned char pad_id[PAD_ID_SIZE], uint64_t pad_size)
+{
+    cipher_header h;
+    container_read_header(cipher_text, &h, pad_id, pad_size);
+    bool checked = h.version >= 3;
+
+    // a version 1 container has no chunks, walk it in blocks all the same
+    cipher_header walk = h;
+    if (walk.chunk_size == 0)
+        walk.chunk_size = CONTAINER_CHUNK_SIZE;
+    uint64_t count = (walk.length + walk.chunk_size - 1) / walk.chunk_size;
+
+    /* A regular file has its table read up front so every chunk is checked
+     * before it is written, a pipe only reaches the table at the very end. */
+    struct stat st;
+    chunk_entry *table = NULL;
+    uint32_t *seen = NULL;
+    if (checked && fstat(fileno(cipher_text), &st) == 0 && S_ISREG(st.st_mode)) {
+        table = malloc((count ? count : 1) * sizeof(chunk_entry));
+        if (table != NULL)
+            container_read_table(fileno(cipher_text), &h, 0, (size_t) count, table);
+    } else if (checked) {
+        seen = malloc((count ? count : 1) * 2 * sizeof(uint32_t));
+    }
+    if (checked && table == NULL && seen == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char *data, *pad;
+    container_alloc(walk.chunk_size, &data, &pad);
+
+    for (uint64_t i = 0; i < count; ++i) {
+        chunk_entry e = container_expected_entry(&walk, i);
+
+        stat_timer t = stats_start();
+        if (fread(data, sizeof(char), e.length, cipher_text) != e.length)
+            size_missmatch();
+        stats_stop(STAT_READ, t);
+        container_read_pad(pad, pad_fd, e.pad_offset, e.length);
+
+        if (checked) {
+            uint32_t cipher_crc = container_crc(data, e.length);
+            uint32_t pad_crc = container_crc(pad, e.length);
+            if (table != NULL) {
+                container_check_chunk(&table[i], i, cipher_crc, pad_crc);
+            } else {
+                seen[2 * i] = cipher_crc;
+                seen[2 * i + 1] = pad_crc;
+            }
+        }
+
+        container_xor(data, pad, e.length);
+        container_write(output, data, e.length);
+    }
+
+    // the table follows the cipher text, so a pipe can only be checked now
+    for (uint64_t i = 0; h.chunk_size != 0 && i < h.chunk_count; ++i) {
+        chunk_entry e = {0}, expected = container_expected_entry(&h, i);
+        if (fread(&e, h.entry_size, 1, cipher_text) != 1)
+            container_corrupt("the chunk table is cut short");
+        if (e.offset != expected.offset || e.pad_offset != expected.pad_offset
+            || e.length != expected.length)
+            container_corrupt("the chunk table does not match the header");
+        if (seen != NULL)
+            container_check_chunk(&e, i, seen[2 * i], seen[2 * i + 1]);
+    }
+
+    if (fgetc(cipher_text) != EOF)
+        size_missmatch();
+
+    free(table);
+    free(seen);
+    free(data);
+    free(pad);
+}
+
+
+void
+container_decrypt_range(FILE *cipher_text, FILE *output, int pad_fd,
+                        const unsigned char pad_id[PAD_ID_SIZE], uint64_t pad_size,
+                        uint64_t offset, uint64_t len)
+{
+    cipher_header h;
+    container_read_header(cipher_text, &h, pad_id, pad_size);
+    if (h.chunk_size == 0) {
+        fprintf(stderr, "fatal: the cipher text has no chunk table, decrypt it whole\n");
+        exit(EXIT_FAILURE);
+    }
+    if (offset > h.length || len > h.length - offset) {
+        fprintf(stderr, "fatal: the range ends after the %llu bytes of plain text\n",
+                (unsigned long long) h.length);
+        exit(EXIT_FAILURE);
+    }
+    if (len == 0)
+        return;
+
+    // only the entries covering the range are read
+    int fd = fileno(cipher_text);
+    uint64_t first = offset / h.chunk_size, last = (offset + len - 1) / h.chunk_size;
+    size_t n_entries = (size_t) (last - first + 1);
+    chunk_entry *entries = malloc(n_entries * sizeof(chunk_entry));
+    if (entries == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    container_read_table(fd, &h, first, n_entries, entries);
+
+    unsigned char *data, *pad;
+    container_alloc(h.chunk_size, &data, &pad);
+
+    for (size_t i = 0; i < n_entries; ++i) {
+        // the table is only used to find the chunks, it has to agree with the header exactly
+        chunk_entry *e = &entries[i], expected = container_expected_entry(&h, first + i);
+        if (e->offset != expected.offset || e->pad_offset != expected.pad_offset
+            || e->length != expected.length)
+            container_corrupt("the chunk table does not match the header");
+
+        // the first and last chunk may only be needed in part, but are checked whole
+        uint64_t start = offset > e->offset ? offset - e->offset : 0;
+        uint64_t end = offset + len - e->offset < e->length ? offset + len - e->offset : e->length;
+        uint64_t read_start = h.version >= 3 ? 0 : start;
+        uint64_t read_end = h.version >= 3 ? e->length : end;
+        size_t n = (size_t) (read_end - read_start);
+
+        stat_timer t = stats_start();
+        if (!pread_full(fd, data, n, (off_t) (h.header_size + e->offset + read_start)))
+            size_missmatch();
+        stats_stop(STAT_READ, t);
+        container_read_pad(pad, pad_fd, e->pad_offset + read_start, n);
+
+        if (h.version >= 3)
+            container_check_chunk(e, first + i, container_crc(data, n), container_crc(pad, n));
+
+        size_t skip = (size_t) (start - read_start);
+        container_xor(data + skip, pad + skip, (size_t) (end - start));
+        container_write(output, data + skip, (size_t) (end - start));
+    }
+
+    free(entries);
+    free(data);
+    free(pad);
+}
@@ -0,0 +1,196 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <threads.h>
+#include <immintrin.h>
+
+#include "otp.h"
+
+#define CRC32C_POLY 0x82f63b78u     // Castagnoli, bit-reflected
+#define CRC32C_LONG 8192            // stripe length of the three-way hardware loop
+#define CRC32C_SHORT 256
+
+
+static uint32_t crc32c_table[8][256];           // slicing-by-8 tables for the software path
+static uint32_t crc32c_long_shift[4][256];      // appends CRC32C_LONG zero bytes to a CRC
+static uint32_t crc32c_short_shift[4][256];     // appends CRC32C_SHORT zero bytes to a CRC
+static once_flag crc32c_once = ONCE_FLAG_INIT;
+
+
+static uint32_t
+gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++mat)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+
+static void
+gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; ++n)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+
+/**
+ * Builds the lookup tables that append \p len zero bytes to a CRC, so CRCs
+ * of neighbouring stripes can be combined. \p len has to be a power of two.
+ */
+static void
+crc32c_zeros(uint32_t zeros[4][256], size_t len)
+{
+    uint32_t even[32], odd[32];
+
+    // the operator for one zero bit, squared up to one zero byte and then len bytes
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; ++n)
+        odd[n] = 1u << (n - 1);
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    uint32_t *op = even;
+    for (;;) {
+        gf2_matrix_square(even, odd);
+        op = even;
+        len >>= 1;
+        if (len == 0)
+            break;
+        gf2_matrix_square(odd, even);
+        op = odd;
+        len >>= 1;
+        if (len == 0)
+            break;
+    }
+
+    for (uint32_t n = 0; n < 256; ++n) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+
+static uint32_t
+crc32c_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff]
+           ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+
+static void
+crc32c_init_tables(void)
+{
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; ++k)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; ++n)
+        for (int k = 1; k < 8; ++k)
+            crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8)
+                                 ^ crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+
+    crc32c_zeros(crc32c_long_shift, CRC32C_LONG);
+    crc32c_zeros(crc32c_short_shift, CRC32C_SHORT);
+}
+
+
+/**
+ * Portable slicing-by-8 implementation.
+ */
+static uint32_t
+crc32c_software(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    crc = ~crc;
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff]
+              ^ crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff]
+              ^ crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff]
+              ^ crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+    }
+    for (; len; ++buf, --len)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf) & 0xff];
+    return ~crc;
+}
+
+
+/**
+ * The crc32 instruction has a latency of three cycles but a throughput of
+ * one, so three independent stripes are kept in flight and combined.
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    uint64_t crc0 = ~crc;
+
+    for (size_t stripe = CRC32C_LONG; stripe >= CRC32C_SHORT; stripe = CRC32C_SHORT) {
+        uint32_t (*zeros)[256] = stripe == CRC32C_LONG ? crc32c_long_shift : crc32c_short_shift;
+        for (; len >= 3 * stripe; buf += 3 * stripe, len -= 3 * stripe) {
+            uint64_t crc1 = 0, crc2 = 0;
+            for (size_t i = 0; i < stripe; i += 8) {
+                uint64_t w0, w1, w2;
+                memcpy(&w0, buf + i, 8);
+                memcpy(&w1, buf + stripe + i, 8);
+                memcpy(&w2, buf + 2 * stripe + i, 8);
+                crc0 = _mm_crc32_u64(crc0, w0);
+                crc1 = _mm_crc32_u64(crc1, w1);
+                crc2 = _mm_crc32_u64(crc2, w2);
+            }
+            crc0 = crc32c_shift(zeros, (uint32_t) crc0) ^ crc1;
+            crc0 = crc32c_shift(zeros, (uint32_t) crc0) ^ crc2;
+        }
+        if (stripe == CRC32C_SHORT)
+            break;
+    }
+
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, buf, 8);
+        crc0 = _mm_crc32_u64(crc0, w);
+    }
+    for (; len; ++buf, --len)
+        crc0 = _mm_crc32_u8((uint32_t) crc0, *buf);
+    return ~(uint32_t) crc0;
+}
+
+
+static uint32_t (*crc32c_kernel)(uint32_t, const unsigned char *, size_t);
+static const char *crc32c_kernel_name;
+
+
+static void
+crc32c_select(void)
+{
+    crc32c_init_tables();
+
+    __builtin_cpu_init();
+    bool hw = __builtin_cpu_supports("sse4.2");
+    crc32c_kernel = hw ? crc32c_sse42 : crc32c_software;
+    crc32c_kernel_name = hw ? "SSE4.2" : "software";
+}
+
+
+const char *
+crc32c_init(void)
+{
+    call_once(&crc32c_once, crc32c_select);
+    return crc32c_kernel_name;
+}
+
+
+uint32_t
+crc32c(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    crc32c_init();
+    return crc32c_kernel(crc, buf, len);
+}
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+
+
+/**
+ * Paths found below a root directory, relative to that root.
+ */
+typedef struct {
+    const char *root;
+    char **files;
+    size_t n_files, cap_files;
+    char **dirs;
+    size_t n_dirs, cap_dirs;
+    atomic_size_t errors;
+} dir_walk;
+
+
+/**
+ * Returns a malloc()ed "a/b", or a copy of \p b when \p a is empty.
+ */
+static char *
+path_join(const char *a, const char *b)
+{
+    if (a[0] == '\0')
+        return concat(b, "");
+
+    char *dir = concat(a, "/");
+    char *path = concat(dir, b);
+    free(dir);
+    return path;
+}
+
+
+static void
+list_push(char ***list, size_t *n, size_t *cap, char *item)
+{
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *list = realloc(*list, *cap * sizeof(char *));
+        if (*list == NULL) {
+            fprintf(stderr, "fatal: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*list)[(*n)++] = item;
+}
+
+
+/**
+ * Checks that \p path from a pad index stays below the directory it is
+ * joined to: it must be relative and must not have a ".." component.
+ */
+static bool
+path_is_contained(const char *path)
+{
+    if (path[0] == '/')
+        return false;
+
+    // p is the start of each component in turn
+    for (const char *p = path;; ++p) {
+        if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+            return false;
+        p = strchr(p, '/');
+        if (p == NULL)
+            return true;
+    }
+}
+
+
+static int
+compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+
+/**
+ * Creates \p path, and when \p parents_only is set only the directories
+ * leading up to its last component. Existing directories are fine.
+ */
+static bool
+make_dirs(const char *path, bool parents_only)
+{
+    char *copy = concat(path, "");
+    bool ok = true;
+
+    for (char *p = copy + 1; ok && *p; ++p) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        ok = mkdir(copy, 0755) == 0 || errno == EEXIST;
+        *p = '/';
+    }
+    if (ok && !parents_only)
+        ok = mkdir(copy, 0755) == 0 || errno == EEXIST;
+
+    free(copy);
+    return ok;
+}
+
+
+/**
+ * Lists one directory, spawning an OpenMP task for every subdirectory so
+ * the tree is walked in parallel. Must run inside a parallel region.
+ */
+static void
+dir_walk_tree(dir_walk *w, const char *rel)
+{
+    char *path = path_join(w->root, rel);
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        atomic_fetch_add(&w->errors, 1);
+        free(path);
+        return;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+
+        char *child = path_join(rel, e->d_name);
+        unsigned char type = e->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            char *full = path_join(w->root, child);
+            type = lstat(full, &st) != 0 ? DT_UNKNOWN
+                   : S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            free(full);
+        }
+
+        if (type == DT_DIR) {
+            #pragma omp critical(dir_walk)
+            list_push(&w->dirs, &w->n_dirs, &w->cap_dirs, concat(child, ""));
+
+            #pragma omp task firstprivate(child)
+            {
+                dir_walk_tree(w, child);
+                free(child);
+            }
+        } else if (type == DT_REG && strchr(child, '\n') == NULL) {
+            #pragma omp critical(dir_walk)
+            list_push(&w->files, &w->n_files, &w->cap_files, child);
+        } else {
+            // links, devices and names the pad index can not hold are left alone
+            fprintf(stderr, "%s/%s: skipped, not a regular file\n", w->root, child);
+            free(child);
+        }
+    }
+
+    closedir(d);
+    free(path);
+}
+
+
+/**
+ * Walks the tree below w->root and sorts the result, so parents come before
+ * their children and the pad store layout does not depend on the scheduling.
+ */
+static void
+dir_collect(dir_walk *w)
+{
+    atomic_init(&w->errors, 0);
+
+    #pragma omp parallel
+    #pragma omp single
+    dir_walk_tree(w, "");
+
+    qsort(w->files, w->n_files, sizeof(char *), compare_paths);
+    qsort(w->dirs, w->n_dirs, sizeof(char *), compare_paths);
+}
+
+
+static void
+dir_walk_free(dir_walk *w)
+{
+    for (size_t i = 0; i < w->n_files; ++i)
+        free(w->files[i]);
+    for (size_t i = 0; i < w->n_dirs; ++i)
+        free(w->dirs[i]);
+    free(w->files);
+    free(w->dirs);
+}
+
+
+static void
+batch_files_free(batch_file *batch, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        free(batch[i].input);
+        free(batch[i].output);
+        free(batch[i].pad);
+    }
+    free(batch);
+}
+
+
+size_t
+dir_encrypt(const char *dir, const char *out_dir, const char *pad_path, bool pack_pads)
+{
+    dir_walk w = {.root = dir};
+    dir_collect(&w);
+    size_t failures = atomic_load(&w.errors);
+
+    // mirror the directory structure before any file is written
+    if (!make_dirs(out_dir, false) || (!pack_pads && !make_dirs(pad_path, false))) {
+        fprintf(stderr, "Unable to create the output directories\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < w.n_dirs; ++i) {
+        char *out = path_join(out_dir, w.dirs[i]);
+        char *pad = pack_pads ? NULL : path_join(pad_path, w.dirs[i]);
+        if (!make_dirs(out, false) || (pad != NULL && !make_dirs(pad, false))) {
+            fprintf(stderr, "Unable to create \"%s\"\n", out);
+            exit(EXIT_FAILURE);
+        }
+        free(out);
+        free(pad);
+    }
+
+    batch_file *batch = calloc(w.n_files ? w.n_files : 1, sizeof(batch_file));
+    if (batch == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < w.n_files; ++i) {
+        batch[i].input = path_join(dir, w.files[i]);
+        batch[i].output = path_join(out_dir, w.files[i]);
+        batch[i].pad = pack_pads ? concat(pad_path, "") : path_join(pad_path, w.files[i]);
+        batch[i].shared_pad = pack_pads;
+        atomic_init(&batch[i].failed, false);
+
+        // packed pads need every size up front to lay out the store
+        struct stat st;
+        if (pack_pads && stat(batch[i].input, &st) == 0)
+            batch[i].size = st.st_size;
+    }
+
+    if (pack_pads) {
+        off_t total = 0;
+        for (size_t i = 0; i < w.n_files; ++i) {
+            batch[i].pad_offset = total;
+            total += batch[i].size;
+        }
+
+        int fd = open(pad_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0 || ftruncate(fd, total) != 0) {
+            fprintf(stderr, "Unable to create the pad store \"%s\"\n", pad_path);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+
+    failures += batch_execute(true, true, batch, w.n_files);
+
+    if (pack_pads) {
+        char *index_name = concat(pad_path, PAD_INDEX_SUFFIX);
+        FILE *index = fopen(index_name, "w");
+        if (index == NULL) {
+            fprintf(stderr, "Unable to write the pad index \"%s\"\n", index_name);
+            exit(EXIT_FAILURE);
+        }
+
+        // directories have no pad, they are listed so empty ones survive decryption
+        for (size_t i = 0; i < w.n_dirs; ++i)
+            fprintf(index, "-\t-\t%s\n", w.dirs[i]);
+
+        // failed files keep their range in the store but are left out of the index
+        for (size_t i = 0; i < w.n_files; ++i)
+            if (!atomic_load(&batch[i].failed))
+                fprintf(index, "%lld\t%lld\t%s\n", (long long) batch[i].pad_offset,
+                        (long long) batch[i].size, w.files[i]);
+
+        if (fclose(index) != 0) {
+            fprintf(stderr, "Unable to write the pad index \"%s\"\n", index_name);
+            exit(EXIT_FAILURE);
+        }
+        free(index_name);
+    }
+
+    batch_files_free(batch, w.n_files);
+    dir_walk_free(&w);
+    return failures;
+}
+
+
+/**
+ * Reads the index of a packed pad store into \p w as if the tree had been
+ * walked, with the pad ranges stored in \p offsets and \p sizes. Indexes
+ * written before directories were listed only hold files.
+ */
+static void
+dir_read_index(const char *pad_path, dir_walk *w, off_t **offsets, off_t **sizes)
+{
+    char *index_name = concat(pad_path, PAD_INDEX_SUFFIX);
+    FILE *index = fopen(index_name, "r");
+    if (index == NULL) {
+        fprintf(stderr, "Unable to open the pad index \"%s\"\n", index_name);
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t cap = 0, cap_ranges = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, index)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        long long offset, size;
+        int path_start = 0;
+        bool is_dir = strncmp(line, "-\t-\t", 4) == 0;
+        if (is_dir)
+            path_start = 4;
+        if ((!is_dir && sscanf(line, "%lld\t%lld\t%n", &offset, &size, &path_start) != 2)
+            || line[path_start] == '\0') {
+            fprintf(stderr, "fatal: malformed pad index \"%s\"\n", index_name);
+            exit(EXIT_FAILURE);
+        }
+
+        // the paths are joined to the output directory, they must not leave it
+        if (!path_is_contained(line + path_start)) {
+            fprintf(stderr, "fatal: the pad index \"%s\" names \"%s\", outside the tree\n",
+                    index_name, line + path_start);
+            exit(EXIT_FAILURE);
+        }
+
+        if (is_dir) {
+            list_push(&w->dirs, &w->n_dirs, &w->cap_dirs, concat(line + path_start, ""));
+            continue;
+        }
+
+        if (w->n_files == cap_ranges) {
+            cap_ranges = cap_ranges ? cap_ranges * 2 : 64;
+            *offsets = realloc(*offsets, cap_ranges * sizeof(off_t));
+            *sizes = realloc(*sizes, cap_ranges * sizeof(off_t));
+            if (*offsets == NULL || *sizes == NULL) {
+                fprintf(stderr, "fatal: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*offsets)[w->n_files] = (off_t) offset;
+        (*sizes)[w->n_files] = (off_t) size;
+        list_push(&w->files, &w->n_files, &w->cap_files, concat(line + path_start, ""));
+    }
+
+    free(line);
+    fclose(index);
+    free(index_name);
+}
+
+
+size_t
+dir_decrypt(const char *dir, const char *out_dir, const char *pad_path)
+{
+    struct stat st;
+    if (stat(pad_path, &st) != 0) {
+        fprintf(stderr, "Unable to open \"%s\"\n", pad_path);
+        exit(EXIT_FAILURE);
+    }
+    bool packed = S_ISREG(st.st_mode);
+
+    dir_walk w = {.root = dir};
+    off_t *offsets = NULL, *sizes = NULL;
+    if (packed)
+        dir_read_index(pad_path, &w, &offsets, &sizes);
+    else
+        dir_collect(&w);
+    size_t failures = packed ? 0 : atomic_load(&w.errors);
+
+    if (!make_dirs(out_dir, false)) {
+        fprintf(stderr, "Unable to create \"%s\"\n", out_dir);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < w.n_dirs; ++i) {
+        char *out = path_join(out_dir, w.dirs[i]);
+        if (!make_dirs(out, false)) {
+            fprintf(stderr, "Unable to create \"%s\"\n", out);
+            exit(EXIT_FAILURE);
+        }
+        free(out);
+    }
+
+    batch_file *batch = calloc(w.n_files ? w.n_files : 1, sizeof(batch_file));
+    if (batch == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < w.n_files; ++i) {
+        batch[i].input = path_join(dir, w.files[i]);
+        batch[i].output = path_join(out_dir, w.files[i]);
+        batch[i].pad = packed ? concat(pad_path, "") : path_join(pad_path, w.files[i]);
+        batch[i].shared_pad = packed;
+        if (packed) {
+            batch[i].pad_offset = offsets[i];
+            batch[i].size = sizes[i];
+        }
+        atomic_init(&batch[i].failed, false);
+
+        // older indexes only name files, so their directories come from the paths
+        if (!make_dirs(batch[i].output, true)) {
+            fprintf(stderr, "Unable to create the directories of \"%s\"\n", batch[i].output);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    failures += batch_execute(false, true, batch, w.n_files);
+
+    batch_files_free(batch, w.n_files);
+    dir_walk_free(&w);
+    free(offsets);
+    free(sizes);
+    return failures;
+}
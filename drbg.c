@@ -0,0 +1,200 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "otp.h"
+
+/* CTR_DRBG from NIST SP 800-90A with AES-256 and no derivation function:
+ * seedlen is 48 bytes of full-entropy input from rdseed or the kernel, and
+ * every generate request is limited to DRBG_MAX_REQUEST bytes followed by a
+ * state update, which gives backtracking resistance within a pad. */
+#define DRBG_KEY_SIZE 32
+#define DRBG_SEED_SIZE 48
+#define DRBG_BATCH 8                // AES blocks in flight, hides the aesenc latency
+
+
+/**
+ * The working state of one thread's DRBG. V is kept as two native words of
+ * a big-endian 128-bit counter.
+ */
+typedef struct {
+    __m128i round_keys[15];
+    uint64_t v_hi, v_lo;
+    uint64_t reseed_counter;
+    bool seeded;
+} ctr_drbg;
+
+
+static _Thread_local ctr_drbg drbg;
+
+
+#define AES256_EXPAND_EVEN(prev, odd, rcon) \
+    aes256_expand_step(prev, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(odd, rcon), 0xff))
+#define AES256_EXPAND_ODD(prev, even) \
+    aes256_expand_step(prev, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(even, 0), 0xaa))
+
+
+__attribute__((target("aes"))) static inline __m128i
+aes256_expand_step(__m128i key, __m128i assist)
+{
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+
+__attribute__((target("aes"))) static void
+aes256_expand(__m128i rk[15], const unsigned char key[DRBG_KEY_SIZE])
+{
+    rk[0] = _mm_loadu_si128((const __m128i *) key);
+    rk[1] = _mm_loadu_si128((const __m128i *) (key + 16));
+    rk[2] = AES256_EXPAND_EVEN(rk[0], rk[1], 0x01);
+    rk[3] = AES256_EXPAND_ODD(rk[1], rk[2]);
+    rk[4] = AES256_EXPAND_EVEN(rk[2], rk[3], 0x02);
+    rk[5] = AES256_EXPAND_ODD(rk[3], rk[4]);
+    rk[6] = AES256_EXPAND_EVEN(rk[4], rk[5], 0x04);
+    rk[7] = AES256_EXPAND_ODD(rk[5], rk[6]);
+    rk[8] = AES256_EXPAND_EVEN(rk[6], rk[7], 0x08);
+    rk[9] = AES256_EXPAND_ODD(rk[7], rk[8]);
+    rk[10] = AES256_EXPAND_EVEN(rk[8], rk[9], 0x10);
+    rk[11] = AES256_EXPAND_ODD(rk[9], rk[10]);
+    rk[12] = AES256_EXPAND_EVEN(rk[10], rk[11], 0x20);
+    rk[13] = AES256_EXPAND_ODD(rk[11], rk[12]);
+    rk[14] = AES256_EXPAND_EVEN(rk[12], rk[13], 0x40);
+}
+
+
+/**
+ * Steps V and returns it in the byte order AES consumes.
+ */
+static inline __m128i
+drbg_next_counter(ctr_drbg *d)
+{
+    if (++d->v_lo == 0)
+        ++d->v_hi;
+    return _mm_set_epi64x((long long) __builtin_bswap64(d->v_lo), (long long) __builtin_bswap64(d->v_hi));
+}
+
+
+/**
+ * Encrypts the next \p n_blocks counter values into \p out, DRBG_BATCH at a time.
+ */
+__attribute__((target("aes"))) static void
+drbg_blocks(ctr_drbg *d, unsigned char *out, size_t n_blocks)
+{
+    const __m128i *rk = d->round_keys;
+    size_t i = 0;
+    for (; i + DRBG_BATCH <= n_blocks; i += DRBG_BATCH) {
+        __m128i b[DRBG_BATCH];
+        for (int j = 0; j < DRBG_BATCH; ++j)
+            b[j] = _mm_xor_si128(drbg_next_counter(d), rk[0]);
+        for (int r = 1; r < 14; ++r)
+            for (int j = 0; j < DRBG_BATCH; ++j)
+                b[j] = _mm_aesenc_si128(b[j], rk[r]);
+        for (int j = 0; j < DRBG_BATCH; ++j)
+            _mm_storeu_si128((__m128i *) (out + (i + j) * 16), _mm_aesenclast_si128(b[j], rk[14]));
+    }
+    for (; i < n_blocks; ++i) {
+        __m128i b = _mm_xor_si128(drbg_next_counter(d), rk[0]);
+        for (int r = 1; r < 14; ++r)
+            b = _mm_aesenc_si128(b, rk[r]);
+        _mm_storeu_si128((__m128i *) (out + i * 16), _mm_aesenclast_si128(b, rk[14]));
+    }
+}
+
+
+/**
+ * CTR_DRBG_Update: replaces Key and V with the next seedlen bytes of the
+ * keystream, XORed with \p provided (NULL for all zeros).
+ */
+static void
+drbg_update(ctr_drbg *d, const unsigned char provided[DRBG_SEED_SIZE])
+{
+    unsigned char temp[DRBG_SEED_SIZE];
+    drbg_blocks(d, temp, DRBG_SEED_SIZE / 16);
+    if (provided != NULL)
+        for (int i = 0; i < DRBG_SEED_SIZE; ++i)
+            temp[i] ^= provided[i];
+
+    aes256_expand(d->round_keys, temp);
+    memcpy(&d->v_hi, temp + 32, sizeof(d->v_hi));
+    memcpy(&d->v_lo, temp + 40, sizeof(d->v_lo));
+    d->v_hi = __builtin_bswap64(d->v_hi);
+    d->v_lo = __builtin_bswap64(d->v_lo);
+    memset(temp, 0, sizeof(temp));
+}
+
+
+/**
+ * Reads seedlen bytes of entropy input, from rdseed where the CPU has it
+ * and from the kernel when it does not or rdseed stays exhausted.
+ */
+static bool
+drbg_entropy(unsigned char seed[DRBG_SEED_SIZE])
+{
+    if (__builtin_cpu_supports("rdseed") && rdseed_fill(seed, DRBG_SEED_SIZE))
+        return true;
+    return pad_engines[PAD_ENGINE_GETRANDOM].fill(seed, DRBG_SEED_SIZE);
+}
+
+
+/**
+ * Instantiates the DRBG on first use and reseeds it every
+ * DRBG_RESEED_INTERVAL requests. Both start from fresh entropy input;
+ * instantiate does so from an all-zero Key and V.
+ */
+static bool
+drbg_reseed(ctr_drbg *d)
+{
+    unsigned char seed[DRBG_SEED_SIZE];
+    if (!drbg_entropy(seed))
+        return false;
+
+    if (!d->seeded) {
+        static const unsigned char zero_key[DRBG_KEY_SIZE] = {0};
+        aes256_expand(d->round_keys, zero_key);
+        d->v_hi = d->v_lo = 0;
+        d->seeded = true;
+    }
+    drbg_update(d, seed);
+    memset(seed, 0, sizeof(seed));
+    d->reseed_counter = 1;
+    stats_add(STAT_DRBG_RESEEDS, 1);
+    return true;
+}
+
+
+bool
+drbg_fill(unsigned char *buf, size_t len)
+{
+    ctr_drbg *d = &drbg;
+    while (len > 0) {
+        if (!d->seeded || d->reseed_counter > DRBG_RESEED_INTERVAL)
+            if (!drbg_reseed(d))
+                return false;
+
+        size_t n = len < DRBG_MAX_REQUEST ? len : DRBG_MAX_REQUEST;
+        drbg_blocks(d, buf, n / 16);
+        if (n % 16) {
+            unsigned char tail[16];
+            drbg_blocks(d, tail, 1);
+            memcpy(buf + n - n % 16, tail, n % 16);
+        }
+        drbg_update(d, NULL);
+        ++d->reseed_counter;
+
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+bool
+drbg_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes");
+}
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "otp.h"
+
+
+/**
+ * Fills \p buf from the kernel's pool through getrandom(), which returns at
+ * most 32 MiB per call and may be cut short by a signal.
+ */
+static bool
+getrandom_fill(unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = getrandom(buf, len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+
+static int urandom_fd = -1;
+static once_flag urandom_once = ONCE_FLAG_INIT;
+
+
+static void
+urandom_open(void)
+{
+    urandom_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+}
+
+
+/**
+ * Fills \p buf by reading /dev/urandom, for kernels and sandboxes that do
+ * not offer getrandom().
+ */
+static bool
+urandom_fill(unsigned char *buf, size_t len)
+{
+    call_once(&urandom_once, urandom_open);
+    if (urandom_fd < 0)
+        return false;
+
+    while (len > 0) {
+        ssize_t n = read(urandom_fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+
+static bool
+cpu_has_rdrand(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("rdrnd");
+}
+
+
+static bool
+cpu_has_rdseed(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("rdseed");
+}
+
+
+const pad_engine_info pad_engines[PAD_ENGINE_COUNT] = {
+    [PAD_ENGINE_RDRAND] = {"rdrand", cpu_has_rdrand, rdrand_fill, false},
+    [PAD_ENGINE_RDSEED] = {"rdseed", cpu_has_rdseed, rdseed_fill, false},
+    [PAD_ENGINE_GETRANDOM] = {"getrandom", NULL, getrandom_fill, false},
+    [PAD_ENGINE_URANDOM] = {"urandom", NULL, urandom_fill, false},
+    [PAD_ENGINE_CTR_DRBG] = {"ctr_drbg", drbg_supported, drbg_fill, true},
+};
+
+
+/* The engines pad_fill() may use, in the order it falls back through them.
+ * pad_engine_current indexes the one in use and only ever moves forward, so
+ * threads that see the same engine fail agree on its successor. */
+static E_PAD_ENGINE pad_engine_order[PAD_ENGINE_COUNT];
+static size_t pad_engine_order_len;
+static atomic_size_t pad_engine_current;
+static atomic_bool pad_engine_selected;
+static once_flag pad_engine_once = ONCE_FLAG_INIT;
+
+
+static bool
+engine_supported(E_PAD_ENGINE e)
+{
+    return pad_engines[e].supported == NULL || pad_engines[e].supported();
+}
+
+
+/**
+ * Appends the supported engines other than \p skip that are
+ * \p deterministic or not to the fallback order, in table order.
+ */
+static void
+pad_engine_append(bool deterministic, E_PAD_ENGINE skip)
+{
+    for (int e = 0; e < PAD_ENGINE_COUNT; ++e)
+        if (e != (int) skip && pad_engines[e].deterministic == deterministic
+            && engine_supported((E_PAD_ENGINE) e))
+            pad_engine_order[pad_engine_order_len++] = (E_PAD_ENGINE) e;
+}
+
+
+/**
+ * Times every supported non-deterministic engine on PAD_ENGINE_PROBE_SIZE
+ * bytes and lines up those that succeed, fastest first. A deterministic
+ * engine would win on speed alone, so they only follow as a last resort.
+ */
+static bool
+pad_engine_probe(void)
+{
+    unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, PAD_ENGINE_PROBE_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the pad engine probe\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double seconds[PAD_ENGINE_COUNT];
+    size_t n = 0;
+    for (int e = 0; e < PAD_ENGINE_COUNT; ++e) {
+        if (pad_engines[e].deterministic || !engine_supported((E_PAD_ENGINE) e))
+            continue;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ok = pad_engines[e].fill(buf, PAD_ENGINE_PROBE_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!ok)
+            continue;
+
+        // insertion sort, there are only a handful of engines
+        double s = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+        size_t i = n++;
+        for (; i > 0 && seconds[i - 1] > s; --i) {
+            seconds[i] = seconds[i - 1];
+            pad_engine_order[i] = pad_engine_order[i - 1];
+        }
+        seconds[i] = s;
+        pad_engine_order[i] = (E_PAD_ENGINE) e;
+    }
+
+    memset(buf, 0, PAD_ENGINE_PROBE_SIZE);
+    free(buf);
+    pad_engine_order_len = n;
+    pad_engine_append(true, PAD_ENGINE_COUNT);
+    if (n == 0 && pad_engine_order_len > 0)
+        fprintf(stderr, "warning: no non-deterministic pad engine works, falling back to %s\n",
+                pad_engines[pad_engine_order[0]].name);
+    return pad_engine_order_len > 0;
+}
+
+
+bool
+pad_engine_select(E_PAD_ENGINE engine)
+{
+    if (engine == PAD_ENGINE_AUTO) {
+        if (!pad_engine_probe())
+            return false;
+    } else {
+        if (!engine_supported(engine))
+            return false;
+
+        pad_engine_order[0] = engine;
+        pad_engine_order_len = 1;
+        pad_engine_append(false, engine);
+        pad_engine_append(true, engine);
+    }
+
+    atomic_store(&pad_engine_current, 0);
+    atomic_store(&pad_engine_selected, true);
+    return true;
+}
+
+
+static void
+pad_engine_select_default(void)
+{
+    if (!atomic_load(&pad_engine_selected) && !pad_engine_select(PAD_ENGINE_AUTO)) {
+        fprintf(stderr, "fatal: none of the pad engines works on this system\n");
+        exit(3);
+    }
+}
+
+
+const char *
+pad_engine_init(void)
+{
+    call_once(&pad_engine_once, pad_engine_select_default);
+    return pad_engine_name();
+}
+
+
+bool
+pad_fill(unsigned char *buf, size_t len)
+{
+    if (!atomic_load(&pad_engine_selected))
+        call_once(&pad_engine_once, pad_engine_select_default);
+
+    size_t i = atomic_load(&pad_engine_current);
+    while (i < pad_engine_order_len) {
+        const char *engine = pad_engines[pad_engine_order[i]].name;
+        if (pad_engines[pad_engine_order[i]].fill(buf, len)) {
+            const char *failed = health_test(buf, len);
+            if (failed == NULL)
+                return true;
+            fprintf(stderr, "warning: the %s pad engine failed the %s health test\n", engine, failed);
+        }
+
+        // only the thread that moves past the engine reports it
+        size_t expected = i;
+        if (atomic_compare_exchange_strong(&pad_engine_current, &expected, i + 1)) {
+            stats_add(STAT_ENGINE_FAILOVERS, 1);
+            if (i + 1 < pad_engine_order_len) {
+                const pad_engine_info *next = &pad_engines[pad_engine_order[i + 1]];
+                fprintf(stderr, "warning: the %s pad engine failed, switching to %s%s\n", engine,
+                        next->name, next->deterministic ? ", a deterministic generator" : "");
+            }
+            i = i + 1;
+        } else {
+            i = expected;
+        }
+    }
+
+    return false;
+}
+
+
+E_PAD_ENGINE
+pad_engine_parse(const char *name)
+{
+    if (strcmp(name, "auto") == 0)
+        return PAD_ENGINE_AUTO;
+    for (int e = 0; e < PAD_ENGINE_COUNT; ++e)
+        if (strcmp(name, pad_engines[e].name) == 0)
+            return (E_PAD_ENGINE) e;
+    return PAD_ENGINE_COUNT;
+}
+
+
+const char *
+pad_engine_name(void)
+{
+    if (!atomic_load(&pad_engine_selected))
+        return "none";
+
+    size_t i = atomic_load(&pad_engine_current);
+    return i < pad_engine_order_len ? pad_engines[pad_engine_order[i]].name : "none";
+}
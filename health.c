@@ -0,0 +1,236 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <threads.h>
+#include <immintrin.h>
+
+#include "otp.h"
+
+/* Continuous health tests from NIST SP 800-90B section 4.4, assuming full
+ * entropy. The repetition count test takes 64-bit words as samples: with 64
+ * bits of entropy each its cutoff is 2, any word equal to the one before it
+ * fails, which happens by chance with probability 2^-64. The adaptive
+ * proportion test takes bytes as samples, so a source stuck on a few values
+ * is caught even when no two words repeat. */
+#define HEALTH_APT_VECTORS (HEALTH_APT_WINDOW / 32)
+#define HEALTH_APT_VECTORS_512 (HEALTH_APT_WINDOW / 64)
+
+
+/**
+ * The last word the calling thread tested, so repetitions are also caught
+ * across calls.
+ */
+static _Thread_local uint64_t health_last;
+static _Thread_local bool health_have_last;
+
+
+/**
+ * Counts the set bits of \p len bytes, the bit frequency reported by --stats.
+ */
+__attribute__((target("popcnt"))) static unsigned long long
+health_ones(const unsigned char *buf, size_t len)
+{
+    unsigned long long ones = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, buf + i, sizeof(w));
+        ones += (unsigned long long) __builtin_popcountll(w);
+    }
+    for (; i < len; ++i)
+        ones += (unsigned long long) __builtin_popcount(buf[i]);
+    return ones;
+}
+
+
+static bool
+health_rct_scalar(const unsigned char *buf, size_t n_words)
+{
+    uint64_t repeated = 0;
+    for (size_t i = 0; i + 1 < n_words; ++i) {
+        uint64_t a, b;
+        memcpy(&a, buf + i * 8, sizeof(a));
+        memcpy(&b, buf + i * 8 + 8, sizeof(b));
+        repeated |= a == b;
+    }
+    return !repeated;
+}
+
+
+static bool
+health_apt_scalar(const unsigned char *window)
+{
+    unsigned count = 0;
+    for (size_t i = 0; i < HEALTH_APT_WINDOW; ++i)
+        count += window[i] == window[0];
+    return count < HEALTH_APT_CUTOFF;
+}
+
+
+/**
+ * Compares every word with its successor four at a time, the mismatches
+ * are only checked once at the end.
+ */
+__attribute__((target("avx2"))) static bool
+health_rct_avx2(const unsigned char *buf, size_t n_words)
+{
+    __m256i repeated = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 5 <= n_words; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (buf + i * 8));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (buf + i * 8 + 8));
+        repeated = _mm256_or_si256(repeated, _mm256_cmpeq_epi64(a, b));
+    }
+    return _mm256_testz_si256(repeated, repeated) && health_rct_scalar(buf + i * 8, n_words - i);
+}
+
+
+/**
+ * Counts the bytes of a window equal to its first byte. A match is -1 in
+ * its lane, so subtracting the comparisons counts them per lane without
+ * overflowing (at most HEALTH_APT_VECTORS each) and the lanes are summed
+ * once per window.
+ */
+__attribute__((target("avx2"))) static bool
+health_apt_avx2(const unsigned char *window)
+{
+    __m256i first = _mm256_set1_epi8((char) window[0]);
+    __m256i counts = _mm256_setzero_si256();
+    for (size_t i = 0; i < HEALTH_APT_VECTORS; ++i) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (window + i * 32));
+        counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(v, first));
+    }
+
+    __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+    unsigned long long count = (unsigned long long) _mm256_extract_epi64(sums, 0)
+                               + (unsigned long long) _mm256_extract_epi64(sums, 1)
+                               + (unsigned long long) _mm256_extract_epi64(sums, 2)
+                               + (unsigned long long) _mm256_extract_epi64(sums, 3);
+    return count < HEALTH_APT_CUTOFF;
+}
+
+
+/**
+ * The AVX2 kernels eight words or 64 bytes at a time, with the comparisons
+ * going straight to mask registers.
+ */
+__attribute__((target("avx512f"))) static bool
+health_rct_avx512(const unsigned char *buf, size_t n_words)
+{
+    __mmask8 repeated = 0;
+    size_t i = 0;
+    for (; i + 9 <= n_words; i += 8) {
+        __m512i a = _mm512_loadu_si512(buf + i * 8);
+        __m512i b = _mm512_loadu_si512(buf + i * 8 + 8);
+        repeated |= _mm512_cmpeq_epi64_mask(a, b);
+    }
+    return !repeated && health_rct_scalar(buf + i * 8, n_words - i);
+}
+
+
+__attribute__((target("avx512bw"))) static bool
+health_apt_avx512(const unsigned char *window)
+{
+    __m512i first = _mm512_set1_epi8((char) window[0]);
+    __m512i counts = _mm512_setzero_si512();
+    for (size_t i = 0; i < HEALTH_APT_VECTORS_512; ++i) {
+        __m512i v = _mm512_loadu_si512(window + i * 64);
+        counts = _mm512_mask_sub_epi8(counts, _mm512_cmpeq_epi8_mask(v, first), counts,
+                                      _mm512_set1_epi8(-1));
+    }
+
+    __m512i sums = _mm512_sad_epu8(counts, _mm512_setzero_si512());
+    return (unsigned long long) _mm512_reduce_add_epi64(sums) < HEALTH_APT_CUTOFF;
+}
+
+
+/**
+ * A pair of test kernels and a check for whether the running CPU can use
+ * them, \p supported is NULL for the kernels that run everywhere.
+ */
+typedef struct {
+    const char *name;
+    bool (*supported)(void);
+    bool (*rct)(const unsigned char *buf, size_t n_words);
+    bool (*apt)(const unsigned char *window);
+} health_kernel_info;
+
+
+static bool
+cpu_has_avx512bw(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+
+static bool
+cpu_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+
+// widest first, always ending with a baseline pair
+static const health_kernel_info health_kernels[] = {
+    {"AVX-512", cpu_has_avx512bw, health_rct_avx512, health_apt_avx512},
+    {"AVX2", cpu_has_avx2, health_rct_avx2, health_apt_avx2},
+    {"scalar", NULL, health_rct_scalar, health_apt_scalar},
+};
+
+
+static const health_kernel_info *health_kernel;
+static once_flag health_once = ONCE_FLAG_INIT;
+
+
+static void
+health_select(void)
+{
+    size_t i = 0;
+    while (health_kernels[i].supported != NULL && !health_kernels[i].supported())
+        ++i;
+    health_kernel = &health_kernels[i];
+}
+
+
+const char *
+health_init(void)
+{
+    call_once(&health_once, health_select);
+    return health_kernel->name;
+}
+
+
+const char *
+health_test(const unsigned char *buf, size_t len)
+{
+    call_once(&health_once, health_select);
+    size_t n_words = len / 8;
+    const char *failed = NULL;
+
+    if (n_words > 0) {
+        uint64_t first;
+        memcpy(&first, buf, sizeof(first));
+        if ((health_have_last && first == health_last) || !health_kernel->rct(buf, n_words))
+            failed = "repetition count";
+        memcpy(&health_last, buf + (n_words - 1) * 8, sizeof(health_last));
+        health_have_last = true;
+    }
+
+    // a trailing partial window is left out, it is too short to judge
+    size_t windows = len / HEALTH_APT_WINDOW;
+    for (size_t w = 0; w < windows && failed == NULL; ++w)
+        if (!health_kernel->apt(buf + w * HEALTH_APT_WINDOW))
+            failed = "adaptive proportion";
+
+    stats_add(STAT_HEALTH_WINDOWS, windows);
+    if (failed != NULL) {
+        stats_add(STAT_HEALTH_FAILURES, 1);
+        health_have_last = false;
+    } else if (stats_active()) {
+        stats_add(STAT_PAD_ONES, health_ones(buf, len));
+        stats_add(STAT_PAD_BITS, (unsigned long long) len * 8);
+    }
+    return failed;
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <omp.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+
+#define IN_PLACE_MAGIC "OTPJRNL1"
+#define IN_PLACE_SECTORS (IN_PLACE_BLOCK_SIZE / IN_PLACE_SECTOR)
+
+
+/**
+ * One slot of the journal, describing the block that is about to be
+ * overwritten. \p crcs holds the CRC32C of every IN_PLACE_SECTOR bytes of the
+ * block as it was before the XOR, so after a crash each sector can be told
+ * apart as old or new. The journal has two slots written alternately, a torn
+ * write of one leaves the other intact.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t seq;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t file_size;
+    uint32_t encrypting;
+    uint32_t check;             // CRC32C of the slot with check set to 0
+    uint32_t crcs[IN_PLACE_SECTORS];
+} journal_slot;
+
+
+static uint32_t
+journal_check(journal_slot *s)
+{
+    uint32_t check = s->check;
+    s->check = 0;
+    uint32_t crc = crc32c(0, (const unsigned char *) s, sizeof(*s));
+    s->check = check;
+    return crc;
+}
+
+
+static void
+sync_file(int fd, const char *str)
+{
+    if (fdatasync(fd) != 0) {
+        fprintf(stderr, "fatal: unable to flush the %s: %s\n", str, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Writes \p s to its slot and waits until it is durable.
+ */
+static void
+journal_write(int fd, journal_slot *s)
+{
+    s->check = journal_check(s);
+    if (!pwrite_full(fd, (const unsigned char *) s, sizeof(*s),
+                     (off_t) (s->seq % 2) * (off_t) sizeof(*s))) {
+        fprintf(stderr, "fatal: unable to write the in-place journal\n");
+        exit(EXIT_FAILURE);
+    }
+    sync_file(fd, "in-place journal");
+}
+
+
+/**
+ * Reads both slots of the journal behind \p fd and moves the newest intact
+ * one to \p slots[0].
+ * @returns false if neither slot is intact.
+ */
+static bool
+journal_read(int fd, journal_slot slots[2])
+{
+    bool valid[2];
+    for (int i = 0; i < 2; ++i)
+        valid[i] = pread_full(fd, (unsigned char *) &slots[i], sizeof(slots[i]),
+                              (off_t) i * (off_t) sizeof(slots[i]))
+                   && memcmp(slots[i].magic, IN_PLACE_MAGIC, sizeof(slots[i].magic)) == 0
+                   && slots[i].check == journal_check(&slots[i]);
+
+    if (valid[1] && (!valid[0] || slots[1].seq > slots[0].seq))
+        memcpy(&slots[0], &slots[1], sizeof(slots[0]));
+    return valid[0] || valid[1];
+}
+
+
+/**
+ * Finishes the block a crash interrupted. A sector that still has the CRC32C
+ * it had before the XOR is XORed again, one that has it after XORing is
+ * already done. A sector that has it both ways can not be told apart and
+ * stops the recovery. Relies on the storage never tearing a single sector.
+ */
+static void
+journal_recover(int fd, int pad_fd, const journal_slot *s, unsigned char *buf, unsigned char *pad)
+{
+    size_t len = (size_t) s->length;
+    if (!pread_full(fd, buf, len, (off_t) s->offset) || !pread_full(pad_fd, pad, len, (off_t) s->offset)) {
+        fprintf(stderr, "fatal: unable to read the interrupted block\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char sector[IN_PLACE_SECTOR];
+    for (size_t i = 0; i * IN_PLACE_SECTOR < len; ++i) {
+        size_t at = i * IN_PLACE_SECTOR;
+        size_t n = len - at < IN_PLACE_SECTOR ? len - at : IN_PLACE_SECTOR;
+        xor_buffer(sector, buf + at, pad + at, n);
+        bool untouched = crc32c(0, buf + at, n) == s->crcs[i];
+        bool done = crc32c(0, sector, n) == s->crcs[i];
+        if (untouched == done) {
+            fprintf(stderr, "fatal: byte %llu of the file matches %s its old %s its new contents\n",
+                    (unsigned long long) (s->offset + at), untouched ? "both" : "neither",
+                    untouched ? "and" : "nor");
+            exit(3);
+        }
+        if (untouched)
+            memcpy(buf + at, sector, n);
+    }
+
+    if (!pwrite_full(fd, buf, len, (off_t) s->offset)) {
+        fprintf(stderr, "fatal: write error during in-place processing\n");
+        exit(EXIT_FAILURE);
+    }
+    sync_file(fd, "file");
+}
+
+
+void
+xor_in_place(const char *path, const char *otp_path, bool encrypting, FILE *verbose)
+{
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s is an invalid file name\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0)
+        invalid_file_size(encrypting ? "plain text" : "cipher text");
+
+    char *journal_name = concat(path, IN_PLACE_JOURNAL_SUFFIX);
+    int journal_fd = open(journal_name, O_RDWR);
+    bool resuming = journal_fd >= 0;
+    if (!resuming)
+        journal_fd = open(journal_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (journal_fd < 0) {
+        fprintf(stderr, "Unable to open the in-place journal \"%s\"\n", journal_name);
+        exit(EXIT_FAILURE);
+    }
+
+    // an interrupted encryption already wrote part of the pad, which must be kept
+    int flags = encrypting ? O_RDWR | O_CREAT | (resuming ? 0 : O_TRUNC) : O_RDONLY;
+    int pad_fd = open(otp_path, flags, 0600);
+    if (pad_fd < 0) {
+        fprintf(stderr, "Unable to open \"%s\"\n", otp_path);
+        exit(EXIT_FAILURE);
+    }
+    struct stat pad_st;
+    if (!encrypting && (fstat(pad_fd, &pad_st) != 0 || pad_st.st_size != st.st_size))
+        size_missmatch();
+
+    journal_slot *slot = malloc(2 * sizeof(journal_slot));
+    unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, IN_PLACE_BLOCK_SIZE);
+    unsigned char *pad = aligned_alloc(PAD_ALIGNMENT, IN_PLACE_BLOCK_SIZE);
+    if (slot == NULL || buf == NULL || pad == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the in-place buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t next = 0;
+    uint64_t seq = 0;
+    if (!resuming) {
+        sync_parent(journal_name);
+        if (encrypting)
+            sync_parent(otp_path);
+    }
+
+    if (resuming && journal_read(journal_fd, slot)) {
+        if (slot->file_size != (uint64_t) st.st_size || (bool) slot->encrypting != encrypting) {
+            fprintf(stderr, "fatal: \"%s\" was left by an interrupted in-place %s, finish it first\n",
+                    journal_name, slot->encrypting ? "encryption" : "decryption");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(verbose, "debug: resuming \"%s\" at byte %llu\n", path,
+                (unsigned long long) slot->offset);
+        journal_recover(fd, pad_fd, slot, buf, pad);
+        next = (off_t) (slot->offset + slot->length);
+        seq = slot->seq + 1;
+    }
+
+    /* Every block goes through the same steps, each durable before the next:
+     * - the pad of the block, when encrypting
+     * - a journal slot with the CRC32C of every sector as it is now
+     * - the block XORed in place
+     * so the block a crash interrupts can always be finished, see journal_recover().
+     */
+    while (next < st.st_size) {
+        size_t len = st.st_size - next < (off_t) IN_PLACE_BLOCK_SIZE
+                     ? (size_t) (st.st_size - next) : IN_PLACE_BLOCK_SIZE;
+
+        stat_timer t = stats_start();
+        if (!pread_full(fd, buf, len, next) || (!encrypting && !pread_full(pad_fd, pad, len, next))) {
+            fprintf(stderr, "fatal: read error during in-place processing\n");
+            exit(EXIT_FAILURE);
+        }
+        stats_stop(STAT_READ, t);
+        stats_add(STAT_BYTES, len);
+
+        memset(slot, 0, sizeof(journal_slot));
+        memcpy(slot->magic, IN_PLACE_MAGIC, sizeof(slot->magic));
+        slot->seq = seq++;
+        slot->offset = (uint64_t) next;
+        slot->length = len;
+        slot->file_size = (uint64_t) st.st_size;
+        slot->encrypting = encrypting;
+
+        t = stats_start();
+        for (size_t i = 0; i * IN_PLACE_SECTOR < len; ++i) {
+            size_t at = i * IN_PLACE_SECTOR;
+            slot->crcs[i] = crc32c(0, buf + at, len - at < IN_PLACE_SECTOR ? len - at : IN_PLACE_SECTOR);
+        }
+        stats_stop(STAT_CRC, t);
+
+        if (encrypting) {
+            pad_xor_block(buf, pad, len, omp_get_max_threads());
+            t = stats_start();
+            if (!pwrite_full(pad_fd, pad, len, next)) {
+                fprintf(stderr, "fatal: write error during in-place processing\n");
+                exit(EXIT_FAILURE);
+            }
+            sync_file(pad_fd, "one-time-pad");
+            stats_stop(STAT_WRITE, t);
+        } else {
+            t = stats_start();
+            xor_buffer(buf, buf, pad, len);
+            stats_stop(STAT_XOR, t);
+        }
+
+        journal_write(journal_fd, slot);
+
+        t = stats_start();
+        if (!pwrite_full(fd, buf, len, next)) {
+            fprintf(stderr, "fatal: write error during in-place processing\n");
+            exit(EXIT_FAILURE);
+        }
+        // the next journal slot may overwrite the one describing this block
+        sync_file(fd, "file");
+        stats_stop(STAT_WRITE, t);
+
+        next += (off_t) len;
+    }
+
+    close(journal_fd);
+    unlink(journal_name);
+    close(pad_fd);
+    close(fd);
+    free(journal_name);
+    free(slot);
+    free(buf);
+    free(pad);
+}
@@ -0,0 +1,216 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "otp.h"
+
+/* Elements of GF(2^128) modulo x^128 + x^7 + x^2 + x + 1 are held as two
+ * 64-bit words, w[0] holding the coefficients of x^0 to x^63. A 16-byte
+ * block of the message maps to an element by loading both words little-endian. */
+#define GF128_POLY 0x87
+
+
+static void
+gf128_load(uint64_t w[2], const unsigned char *block)
+{
+    memcpy(&w[0], block, 8);
+    memcpy(&w[1], block + 8, 8);
+}
+
+
+/**
+ * Shift-and-add multiplication, the fallback for CPUs without pclmul.
+ */
+static void
+gf128_mul_software(uint64_t r[2], const uint64_t a[2], const uint64_t b[2])
+{
+    uint64_t z[2] = {0, 0}, v[2] = {a[0], a[1]};
+    for (int i = 0; i < 128; ++i) {
+        if ((b[i / 64] >> (i % 64)) & 1) {
+            z[0] ^= v[0];
+            z[1] ^= v[1];
+        }
+        uint64_t carry = v[1] >> 63;
+        v[1] = (v[1] << 1) | (v[0] >> 63);
+        v[0] = (v[0] << 1) ^ (carry ? GF128_POLY : 0);
+    }
+    r[0] = z[0];
+    r[1] = z[1];
+}
+
+
+/**
+ * Folds the 256-bit product hi * x^128 + lo back below x^128, using
+ * x^128 = x^7 + x^2 + x + 1.
+ */
+__attribute__((target("pclmul,sse2"))) static __m128i
+gf128_reduce(__m128i hi, __m128i lo)
+{
+    const __m128i poly = _mm_set_epi64x(0, GF128_POLY);
+    __m128i t1 = _mm_clmulepi64_si128(hi, poly, 0x01);     // x^192 and up, lands at x^64
+    __m128i t2 = _mm_clmulepi64_si128(hi, poly, 0x00);     // x^128 to x^191, lands at x^0
+    __m128i t3 = _mm_clmulepi64_si128(t1, poly, 0x01);     // what t1 pushed past x^128
+    return _mm_xor_si128(_mm_xor_si128(lo, t2), _mm_xor_si128(_mm_slli_si128(t1, 8), t3));
+}
+
+
+/**
+ * Accumulates the unreduced product of \p a and \p b into \p hi / \p lo.
+ */
+__attribute__((target("pclmul,sse2"))) static inline void
+gf128_mul_acc(__m128i a, __m128i b, __m128i *hi, __m128i *lo)
+{
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x01), _mm_clmulepi64_si128(a, b, 0x10));
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8)));
+}
+
+
+__attribute__((target("pclmul,sse2"))) static void
+gf128_mul_pclmul(uint64_t r[2], const uint64_t a[2], const uint64_t b[2])
+{
+    __m128i hi = _mm_setzero_si128(), lo = _mm_setzero_si128();
+    gf128_mul_acc(_mm_loadu_si128((const __m128i *) a), _mm_loadu_si128((const __m128i *) b), &hi, &lo);
+    _mm_storeu_si128((__m128i *) r, gf128_reduce(hi, lo));
+}
+
+
+/**
+ * Horner steps over whole blocks, four at a time against H^4..H so the
+ * four products share a single reduction.
+ */
+__attribute__((target("pclmul,sse2"))) static void
+mac_blocks_pclmul(otp_mac *m, const unsigned char *buf, size_t n_blocks)
+{
+    __m128i acc = _mm_loadu_si128((const __m128i *) m->acc);
+    __m128i h1 = _mm_loadu_si128((const __m128i *) m->h_powers[0]);
+    __m128i h2 = _mm_loadu_si128((const __m128i *) m->h_powers[1]);
+    __m128i h3 = _mm_loadu_si128((const __m128i *) m->h_powers[2]);
+    __m128i h4 = _mm_loadu_si128((const __m128i *) m->h_powers[3]);
+
+    size_t i = 0;
+    for (; i + 4 <= n_blocks; i += 4, buf += 64) {
+        __m128i hi = _mm_setzero_si128(), lo = _mm_setzero_si128();
+        gf128_mul_acc(_mm_xor_si128(acc, _mm_loadu_si128((const __m128i *) buf)), h4, &hi, &lo);
+        gf128_mul_acc(_mm_loadu_si128((const __m128i *) (buf + 16)), h3, &hi, &lo);
+        gf128_mul_acc(_mm_loadu_si128((const __m128i *) (buf + 32)), h2, &hi, &lo);
+        gf128_mul_acc(_mm_loadu_si128((const __m128i *) (buf + 48)), h1, &hi, &lo);
+        acc = gf128_reduce(hi, lo);
+    }
+    for (; i < n_blocks; ++i, buf += 16) {
+        __m128i hi = _mm_setzero_si128(), lo = _mm_setzero_si128();
+        gf128_mul_acc(_mm_xor_si128(acc, _mm_loadu_si128((const __m128i *) buf)), h1, &hi, &lo);
+        acc = gf128_reduce(hi, lo);
+    }
+
+    _mm_storeu_si128((__m128i *) m->acc, acc);
+}
+
+
+static void
+mac_blocks_software(otp_mac *m, const unsigned char *buf, size_t n_blocks)
+{
+    for (size_t i = 0; i < n_blocks; ++i, buf += 16) {
+        uint64_t block[2];
+        gf128_load(block, buf);
+        block[0] ^= m->acc[0];
+        block[1] ^= m->acc[1];
+        gf128_mul_software(m->acc, block, m->h_powers[0]);
+    }
+}
+
+
+static bool
+cpu_has_pclmul(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul");
+}
+
+
+void
+mac_init(otp_mac *m, const unsigned char key[MAC_KEY_SIZE])
+{
+    memset(m, 0, sizeof(*m));
+    m->pclmul = cpu_has_pclmul();
+
+    gf128_load(m->h_powers[0], key);
+    gf128_load(m->mask, key + 16);
+    for (int i = 1; i < 4; ++i) {
+        if (m->pclmul)
+            gf128_mul_pclmul(m->h_powers[i], m->h_powers[i - 1], m->h_powers[0]);
+        else
+            gf128_mul_software(m->h_powers[i], m->h_powers[i - 1], m->h_powers[0]);
+    }
+}
+
+
+static void
+mac_blocks(otp_mac *m, const unsigned char *buf, size_t n_blocks)
+{
+    if (m->pclmul)
+        mac_blocks_pclmul(m, buf, n_blocks);
+    else
+        mac_blocks_software(m, buf, n_blocks);
+}
+
+
+void
+mac_update(otp_mac *m, const unsigned char *buf, size_t len)
+{
+    stat_timer t = stats_start();
+    m->bytes += len;
+
+    // finish a block left over from the previous call
+    if (m->partial_len > 0) {
+        size_t n = 16 - m->partial_len < len ? 16 - m->partial_len : len;
+        memcpy(m->partial + m->partial_len, buf, n);
+        m->partial_len += n;
+        buf += n;
+        len -= n;
+        if (m->partial_len < 16) {
+            stats_stop(STAT_MAC, t);
+            return;
+        }
+        mac_blocks(m, m->partial, 1);
+        m->partial_len = 0;
+    }
+
+    mac_blocks(m, buf, len / 16);
+    m->partial_len = len % 16;
+    memcpy(m->partial, buf + len - m->partial_len, m->partial_len);
+    stats_stop(STAT_MAC, t);
+}
+
+
+void
+mac_final(otp_mac *m, unsigned char tag[MAC_TAG_SIZE])
+{
+    // a zero-padded last block, then the length in bits so padding can not be forged
+    if (m->partial_len > 0) {
+        memset(m->partial + m->partial_len, 0, 16 - m->partial_len);
+        mac_blocks(m, m->partial, 1);
+    }
+    unsigned char length_block[16] = {0};
+    uint64_t bits = m->bytes * 8;
+    memcpy(length_block, &bits, sizeof(bits));
+    mac_blocks(m, length_block, 1);
+
+    uint64_t out[2] = {m->acc[0] ^ m->mask[0], m->acc[1] ^ m->mask[1]};
+    memcpy(tag, out, MAC_TAG_SIZE);
+    memset(m, 0, sizeof(*m));
+}
+
+
+bool
+mac_verify(otp_mac *m, const unsigned char tag[MAC_TAG_SIZE])
+{
+    unsigned char expected[MAC_TAG_SIZE];
+    mac_final(m, expected);
+
+    unsigned char diff = 0;
+    for (int i = 0; i < MAC_TAG_SIZE; ++i)
+        diff |= expected[i] ^ tag[i];
+    return diff == 0;
+}
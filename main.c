@@ -1,74 +1,67 @@
 #include <stdio.h>
-#include <immintrin.h>  // Intel random generation engine
+#include <stdlib.h>
+#include <string.h>
 #include <stdnoreturn.h>
 #include <stdbool.h>
+#include <omp.h>
+#include <time.h>
+#include <sys/stat.h>
 
-#define ULL_SIZE sizeof(unsigned long long)
+#include "otp.h"
 
-typedef union {
-    unsigned char c[ULL_SIZE];
-    unsigned long long ull;
-} char_container;
-
-
-typedef enum {OTP_ENCRYPT, OTP_DECRYPT, OTP_NULLMODE, OTP_ERROR} E_PROGRAM_MODE;
-
-/**
- * Returns the length of an open file \p fp.
- * @param fp The to take the length of.
- * @returns The lenght of file \p fp.
- */
-long
-fsize(FILE *fp);
-
-
-/**
- * Encrypts in input file, using random numbers generated from a secure source
- * and outputs the random bits and encrypted message.
- * @param plain_text [in]  An open connection to the plain-text file in binary read mode.
- * @param output     [out] An open connection to the output file in binary write mode.
- * @param otp        [out] An open connection to a file that will contain the one-time-pad for \p output.
- */
-void
-encrypt(FILE* plain_text, FILE* ouput, FILE* otp);
-
-
-/**
- * Decrypts in input file using a one-time-pad and directing the output to a specified output.
- * @param cipher_text [in]  An open connection to the cipher-text file in binary read mode.
- * @param output      [out] An open connection to the output file in binary write mode.
- * @param otp         [in]  An open connection to the one-time-pad in binary read mode.
- */
-void
-decrypt(FILE* cipher_text, FILE* output, FILE* otp);
+typedef enum {
+    OTP_ENCRYPT, OTP_DECRYPT, OTP_BATCH_ENCRYPT, OTP_BATCH_DECRYPT, OTP_DIR_ENCRYPT,
+    OTP_DIR_DECRYPT, OTP_NULLMODE, OTP_ERROR
+} E_PROGRAM_MODE;
 
 
 /**
- * Exit routine when an invalid file is specified.
- * @param str A string indicating which file was invalid.
+ * Generic exit routine and print usage function. Exits the program with code 2.
+ * @param argc The number of arguments present in \p argc.
+ * @param argv The input arguments in the form of NULL-terminated strings.
  */
 noreturn void
-invalid_file_size(const char *str);
+print_usage(int argc, char* const argv[argc])
+{
+    fprintf(stderr, "debug: print usage has not been implemented yet\n");
+    exit(2);
+}
 
 
 /**
- * Exit routine for when there is a size mismatch between the cipher text and
- *  the one-time-pad.
+ * Selects the pad engine called \p name, exiting if it is unknown (code 1)
+ * or the CPU can not run it (code 3).
  */
-noreturn void
-size_missmatch(void);
+static void
+select_pad_engine(const char *name)
+{
+    E_PAD_ENGINE engine = pad_engine_parse(name);
+    if (engine == PAD_ENGINE_COUNT) {
+        fprintf(stderr, "Invalid pad engine \"%s\", expected \"auto\", \"rdrand\", \"rdseed\", "
+                        "\"getrandom\", \"urandom\" or \"ctr_drbg\"\n", name);
+        exit(EXIT_FAILURE);
+    }
+    if (!pad_engine_select(engine)) {
+        if (engine == PAD_ENGINE_AUTO)
+            fprintf(stderr, "fatal: none of the pad engines works on this system\n");
+        else
+            fprintf(stderr, "fatal: this CPU does not support the %s pad engine\n", name);
+        exit(3);
+    }
+}
 
 
 /**
- * Generic exit routine and print usage function. Exits the program with code 2.
- * @param argc The number of arguments present in \p argc.
- * @param argv The input arguments in the form of NULL-terminated strings.
+ * Exits if \p option was given to --batch or a directory, which encrypt and
+ * decrypt every file with a pad of its own and have no use for it.
  */
-noreturn void
-print_usage(int argc, char* const argv[argc])
+static void
+reject_bulk_option(bool used, const char *option)
 {
-    fprintf(stderr, "debug: print usage has not been implemented yet\n");
-    exit(2);
+    if (used) {
+        fprintf(stderr, "%s can not be used with --batch or a directory\n", option);
+        exit(EXIT_FAILURE);
+    }
 }
 
 
@@ -79,22 +72,95 @@ print_usage(int argc, char* const argv[argc])
  * - -e / --encrypt Encrypts an input file and outputs the one-time-pad with a unique file name
  * - -d / --decrypt Decrypts an input file and it's one-time-pad
  * - -p / --one-time-pad Selects a name for the one-time-pad
- * - -o output file path/name (optional)
+ * - -o output file path/name (optional, defaults to output.txt / decrypt_output.txt)
+ * - --batch encrypt|decrypt Processes every remaining argument as a file, see batch_run()
+ * - --manifest FILE Adds the files listed in FILE, one per line, to a --batch run
+ * - --pack-pads Packs the pads of a directory into one pad store with an index
+ * - --pad-pool DIR Takes the pad from a pad pool filled by "pad-pool" (encryption only)
+ * - --pad-store STORE Encrypts with the next unused range of a pad store instead of writing
+ *   a pad, decryption recognises a pad store given to -p on its own
+ * - --auth Appends a Wegman-Carter MAC tag to the cipher text, keyed with MAC_KEY_SIZE extra
+ *   bytes of pad, so tampering is detected; decryption recognises such a pair of regular
+ *   files on its own and needs --auth only for a piped cipher text
+ * - --in-place Overwrites the -e / -d input with its result instead of writing -o, keeping a
+ *   journal so a run that was interrupted continues where it stopped when started again
+ * - --resume Continues an encryption of regular files from the checkpoint at "<output>.ckpt",
+ *   which is taken every CHECKPOINT_INTERVAL bytes and removed once the encryption completes
+ * - --range OFFSET:LEN Decrypts only LEN bytes of plain text starting at OFFSET, reading just
+ *   the chunks that hold them (pad store cipher texts only)
+ * - --pad-engine E Generates the pad from rdrand, rdseed, getrandom, urandom (a reader of
+ *   /dev/urandom) or ctr_drbg (an AES-256 CTR_DRBG per thread reseeded every MiB, see
+ *   drbg_fill()); the default, auto, probes the non-deterministic ones and picks the fastest,
+ *   ctr_drbg is only used when named or as the last resort. An engine that fails mid-file,
+ *   or whose output fails the SP 800-90B repetition count or adaptive proportion test, is
+ *   replaced by the next one that works instead of aborting
+ * - --threads N Number of threads generating the one-time-pad (defaults to the OpenMP default)
+ * - --mmap Decrypt through memory mappings instead of stdio (decryption only)
+ * - --io-uring Use the io_uring backend for regular files, falling back to stdio otherwise
+ * - --parallel Decrypt regular files in independent chunks on all threads (decryption only)
+ * - --zero-copy When the cipher text (-e) or plain text (-d) goes to a pipe, hand it over with
+ *   vmsplice() instead of copying it through stdio. The reader must read() the pipe, one that
+ *   splices the data on could see it change
+ * - --direct Write the cipher text and pad files with O_DIRECT, bypassing the page cache for
+ *   all but an unaligned tail (encryption only, falls back to buffered writes where the
+ *   file system refuses it)
+ * - --drop-cache Evict the plain text, cipher text and pad from the page cache as encryption
+ *   goes, for hosts where a large encryption would push out other services' data
+ * - --stats Print per-stage timings, rdrand retries, health test results with the bit frequency
+ *   of the pad, and system call counts as JSON to stderr
+ *
+ * Passing "-" as the -e / -d input reads it from stdin and "-o -" writes the
+ * output to stdout, so the program can sit in the middle of a pipeline. The
+ * one-time-pad always goes to (or comes from) a named file.
+ *
+ * A directory given to -e encrypts the whole tree into a mirrored tree at -o
+ * (default "<dir>.enc") with a mirrored pad tree at -p (default "<dir>.otp"),
+ * or with --pack-pads a single pad store at -p. -d takes the cipher tree and
+ * either kind of pad and writes the plain tree to -o (default "<dir>" without
+ * ".enc", or "<dir>.dec").
+ *
+ * "pad-pool DIR [--reserve N[K|M|G]] [--pad-engine E] [--once] [-v]" runs
+ * the pad pool service instead: it keeps DIR filled with N bytes (default 1G)
+ * of pad material, generated at idle priority, for "-e --pad-pool DIR" to
+ * consume. --once returns as soon as the reserve is full.
+ *
+ * "pad-store create STORE --size N[K|M|G] [--pad-engine E]" creates a pad
+ * store of N bytes to be shipped to the receiver once, see pad_store_create().
+ * The store's header records the engine that finished generating it, and
+ * whether a failover to another engine happened on the way.
  *
  * @param argc The number of arguments present in \p argc.
  * @param argv The input arguments in the form of NULL-terminated strings.
  * @return A status code to the caller (likely the OS).
  * @retval 0 Indicates the program exited successfully.
- * @retval 1 Indicates the program failed in some generic fashion (file not found).
- * @retval 2 Indicates the input file size is to large.
- * @retval 3 Indicates that the Intel random number engine failed to return properly.
+ * @retval 1 Indicates the program failed in some generic fashion (file not found, or
+ *           any file of a batch failed).
+ * @retval 2 Indicates the input file is empty or its size could not be determined.
+ * @retval 3 Indicates that the Intel random number engine failed to return properly, or that
+ *           the cipher text does not match its one-time-pad (length, CRC32C checksum or
+ *           MAC tag).
  */
 int main(int argc, char* argv[argc]) {
-    FILE *input_file, *output_file, *otp_file;
+    FILE *input_file, *output_file, *otp_file = NULL;
     char const *input_file_name = NULL;
-    char const *outpad_file = NULL;
+    char const *output_file_name = NULL;
     char const *otp_file_name = NULL;
     E_PROGRAM_MODE program_mode = OTP_NULLMODE;
+    bool use_mmap = false;
+    bool use_uring = false;
+    bool use_parallel = false;
+    bool print_stats = false;
+    bool pack_pads = false;
+    char const *pad_pool_dir = NULL;
+    char const *pad_store_name = NULL;
+    bool use_range = false;
+    bool use_auth = false;
+    bool use_in_place = false;
+    bool use_resume = false;
+    char *checkpoint_name = NULL;
+    unsigned long long range_offset = 0, range_len = 0;
+    char **batch_files = NULL;
+    size_t batch_count = 0;
 
     bool verbose_print = false;
     FILE *verbose_printer = fopen("/dev/null", "w+");
@@ -104,12 +170,52 @@ int main(int argc, char* argv[argc]) {
         print_usage(argc, argv);
     }
 
+    if (argc > 1 && strcmp(argv[1], "pad-store") == 0) {
+        if ((argc != 6 && (argc != 8 || strcmp(argv[6], "--pad-engine") != 0))
+            || strcmp(argv[2], "create") != 0 || strcmp(argv[4], "--size") != 0) {
+            fprintf(stderr, "usage: %s pad-store create STORE --size N[K|M|G] [--pad-engine E]\n",
+                    argv[0]);
+            exit(2);
+        }
+        if (argc == 8)
+            select_pad_engine(argv[7]);
+        pad_engine_init();
+        pad_store_create(argv[3], (off_t) parse_size(argv[5]));
+        return EXIT_SUCCESS;
+    }
+
+    // the pad pool service takes its own arguments
+    if (argc > 2 && strcmp(argv[1], "pad-pool") == 0) {
+        const char *dir = argv[2];
+        off_t reserve = PAD_POOL_DEFAULT_RESERVE;
+        bool once = false;
+        for (int i = 3; i < argc; ++i) {
+            if (strcmp(argv[i], "--reserve") == 0 && i + 1 < argc) {
+                reserve = (off_t) parse_size(argv[++i]);
+            } else if (strcmp(argv[i], "--pad-engine") == 0 && i + 1 < argc) {
+                select_pad_engine(argv[++i]);
+            } else if (strcmp(argv[i], "--once") == 0) {
+                once = true;
+            } else if (strcmp(argv[i], "-v") == 0) {
+                fclose(verbose_printer);
+                verbose_printer = stderr;
+            } else {
+                fprintf(stderr, "Invalid argument \"%s\"\n", argv[i]);
+                print_usage(argc, argv);
+            }
+        }
+
+        fprintf(verbose_printer, "debug: using the %s pad engine\n", pad_engine_init());
+        pad_pool_serve(dir, reserve, once, verbose_printer);
+        return EXIT_SUCCESS;
+    }
+
     // Process command line arguments
     for (; (argc > 1) && (argv[1][0]) == '-'; --argc, ++argv) {
         switch (argv[1][1]) {
             case 'e':   // Encryption mode
-                if (program_mode == OTP_DECRYPT) {
-                    fprintf(stderr, "-e can not be used with -d\n");
+                if (program_mode != OTP_NULLMODE && program_mode != OTP_ENCRYPT) {
+                    fprintf(stderr, "-e can not be used with -d or --batch\n");
                     exit(EXIT_FAILURE);
                 }
 
@@ -119,8 +225,8 @@ int main(int argc, char* argv[argc]) {
                 program_mode = OTP_ENCRYPT;
                 break;
             case 'd':   // Decryption mode
-                if (program_mode == OTP_ENCRYPT) {
-                    fprintf(stderr, "-d can not be used -e\n");
+                if (program_mode != OTP_NULLMODE && program_mode != OTP_DECRYPT) {
+                    fprintf(stderr, "-d can not be used -e or --batch\n");
                     exit(EXIT_FAILURE);
                 }
                 ++argv;
@@ -134,13 +240,93 @@ int main(int argc, char* argv[argc]) {
                 otp_file_name = argv[1];
                 break;
             case 'o':   // specify output file names or names (mode dependant)
+                ++argv;
+                --argc;
+                output_file_name = argv[1];
                 break;
-            case 'v':   // enable verbose printing
+            case 'v':   // enable verbose printing, stdout may be carrying the output
                 fclose(verbose_printer);
                 verbose_print = true;
-                verbose_printer = stdout;
+                verbose_printer = stderr;
                 break;
             case '-':   // use long name arguments
+                if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+                    ++argv;
+                    --argc;
+                    char *end;
+                    long threads = strtol(argv[1], &end, 10);
+                    if (*end != '\0' || threads <= 0 || threads > 4096) {
+                        fprintf(stderr, "Invalid thread count \"%s\"\n", argv[1]);
+                        exit(EXIT_FAILURE);
+                    }
+                    omp_set_num_threads((int) threads);
+                } else if (strcmp(argv[1], "--pad-engine") == 0 && argc > 2) {
+                    ++argv;
+                    --argc;
+                    select_pad_engine(argv[1]);
+                } else if (strcmp(argv[1], "--mmap") == 0) {
+                    use_mmap = true;
+                } else if (strcmp(argv[1], "--io-uring") == 0) {
+                    use_uring = true;
+                } else if (strcmp(argv[1], "--parallel") == 0) {
+                    use_parallel = true;
+                } else if (strcmp(argv[1], "--zero-copy") == 0) {
+                    zero_copy_request();
+                } else if (strcmp(argv[1], "--direct") == 0) {
+                    direct_io_request();
+                } else if (strcmp(argv[1], "--drop-cache") == 0) {
+                    drop_cache_request();
+                } else if (strcmp(argv[1], "--pad-pool") == 0 && argc > 2) {
+                    ++argv;
+                    --argc;
+                    pad_pool_dir = argv[1];
+                } else if (strcmp(argv[1], "--pad-store") == 0 && argc > 2) {
+                    ++argv;
+                    --argc;
+                    pad_store_name = argv[1];
+                } else if (strcmp(argv[1], "--range") == 0 && argc > 2) {
+                    ++argv;
+                    --argc;
+                    int end = 0;
+                    if (sscanf(argv[1], "%llu:%llu%n", &range_offset, &range_len, &end) != 2
+                        || argv[1][end] != '\0') {
+                        fprintf(stderr, "Invalid range \"%s\", expected OFFSET:LEN\n", argv[1]);
+                        exit(EXIT_FAILURE);
+                    }
+                    use_range = true;
+                } else if (strcmp(argv[1], "--resume") == 0) {
+                    use_resume = true;
+                } else if (strcmp(argv[1], "--in-place") == 0) {
+                    use_in_place = true;
+                } else if (strcmp(argv[1], "--auth") == 0) {
+                    use_auth = true;
+                } else if (strcmp(argv[1], "--pack-pads") == 0) {
+                    pack_pads = true;
+                } else if (strcmp(argv[1], "--stats") == 0) {
+                    print_stats = true;
+                } else if (strcmp(argv[1], "--batch") == 0 && argc > 2) {
+                    ++argv;
+                    --argc;
+                    if (program_mode != OTP_NULLMODE) {
+                        fprintf(stderr, "--batch can not be used with -e or -d\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    if (strcmp(argv[1], "encrypt") == 0) {
+                        program_mode = OTP_BATCH_ENCRYPT;
+                    } else if (strcmp(argv[1], "decrypt") == 0) {
+                        program_mode = OTP_BATCH_DECRYPT;
+                    } else {
+                        fprintf(stderr, "--batch expects \"encrypt\" or \"decrypt\"\n");
+                        exit(EXIT_FAILURE);
+                    }
+                } else if (strcmp(argv[1], "--manifest") == 0 && argc > 2) {
+                    ++argv;
+                    --argc;
+                    batch_files = batch_read_manifest(argv[1], batch_files, &batch_count);
+                } else {
+                    fprintf(stderr, "Invalid argument \"%s\"\n", argv[1]);
+                    print_usage(argc, argv);
+                }
                 break;
             default:
                 fprintf(stderr, "Invalid argument \"%s\"\n", argv[1]);
@@ -148,10 +334,63 @@ int main(int argc, char* argv[argc]) {
         }
     }
 
+    // a directory given to -e or -d is processed as a whole tree
+    struct stat input_stat;
+    if ((program_mode == OTP_ENCRYPT || program_mode == OTP_DECRYPT) && input_file_name != NULL
+        && stat(input_file_name, &input_stat) == 0 && S_ISDIR(input_stat.st_mode))
+        program_mode = program_mode == OTP_ENCRYPT ? OTP_DIR_ENCRYPT : OTP_DIR_DECRYPT;
+
+    fprintf(verbose_printer, "debug: using the %s XOR kernel\n", xor_init());
+    fprintf(verbose_printer, "debug: using the %s CRC32C kernel\n", crc32c_init());
+    fprintf(verbose_printer, "debug: using the %s health test kernels\n", health_init());
+
+    if (print_stats && program_mode != OTP_NULLMODE)
+        stats_enable(program_mode == OTP_ENCRYPT || program_mode == OTP_BATCH_ENCRYPT
+                     || program_mode == OTP_DIR_ENCRYPT ? "encrypt" : "decrypt");
+
+    if (program_mode == OTP_BATCH_ENCRYPT || program_mode == OTP_BATCH_DECRYPT
+        || program_mode == OTP_DIR_ENCRYPT || program_mode == OTP_DIR_DECRYPT) {
+        reject_bulk_option(use_auth, "--auth");
+        reject_bulk_option(pad_store_name != NULL, "--pad-store");
+        reject_bulk_option(use_in_place, "--in-place");
+        reject_bulk_option(pad_pool_dir != NULL, "--pad-pool");
+        reject_bulk_option(use_resume, "--resume");
+    }
+
+    int status = EXIT_SUCCESS;
+
     switch (program_mode) {
         case OTP_ENCRYPT:
+            if (use_mmap || use_parallel) {
+                fprintf(stderr, "--mmap and --parallel can only be used with -d\n");
+                exit(EXIT_FAILURE);
+            }
+            if ((pad_pool_dir != NULL) + (pad_store_name != NULL) + use_uring > 1) {
+                fprintf(stderr, "--pad-pool, --pad-store and --io-uring can not be combined\n");
+                exit(EXIT_FAILURE);
+            }
+            if (use_auth && pad_store_name != NULL) {
+                fprintf(stderr, "--auth can not be used with --pad-store\n");
+                exit(EXIT_FAILURE);
+            }
+
+            fprintf(verbose_printer, "debug: using the %s pad engine\n", pad_engine_init());
+
+            if (use_in_place) {
+                if (strcmp(input_file_name, "-") == 0 || output_file_name != NULL
+                    || pad_pool_dir != NULL || pad_store_name != NULL || use_auth) {
+                    fprintf(stderr, "--in-place needs a named input and no -o, --pad-pool, "
+                                    "--pad-store or --auth\n");
+                    exit(EXIT_FAILURE);
+                }
+                xor_in_place(input_file_name, otp_file_name != NULL ? otp_file_name : "one-time-pad.otp",
+                             true, verbose_printer);
+                break;
+            }
+
             // open requested input file
-            input_file = fopen(input_file_name, "rb");
+            input_file = strcmp(input_file_name, "-") == 0
+                         ? stdin : fopen(input_file_name, "rb");
             if (input_file == NULL) {
                 fprintf(stderr, "%s is an invalid file name\n",
                         input_file_name);
@@ -162,47 +401,115 @@ int main(int argc, char* argv[argc]) {
                         input_file_name);
             }
 
-            // open one-time-pad for writing
-            if (otp_file_name == NULL) {
+            if (output_file_name == NULL)
+                output_file_name = "output.txt";
+
+            // the stdio pipeline checkpoints named files, a resumed run keeps what they hold
+            if (strcmp(input_file_name, "-") != 0 && strcmp(output_file_name, "-") != 0
+                && pad_store_name == NULL && !use_auth && !use_uring)
+                checkpoint_name = concat(output_file_name, CHECKPOINT_SUFFIX);
+            if (use_resume && checkpoint_name == NULL) {
+                fprintf(stderr, "--resume needs named files and can not be combined with "
+                                "--pad-store, --auth or --io-uring\n");
+                exit(EXIT_FAILURE);
+            }
+            const char *write_mode = use_resume ? "r+b" : "wb";
+
+            // open one-time-pad for writing, a pad store already holds the pad
+            if (otp_file_name == NULL && pad_store_name == NULL) {
                 fprintf(verbose_printer,
                         "debug: -p not used, selecting default output name\n");
                 otp_file_name = "one-time-pad.otp";
             }
-            otp_file = fopen(otp_file_name, "wb");
-            if (otp_file == NULL) {
-                fprintf(stderr, "Unable to open \"%s\" in write-binary\n",
-                        otp_file_name);
+            if (pad_store_name == NULL) {
+                otp_file = fopen(otp_file_name, write_mode);
+                if (otp_file == NULL) {
+                    fprintf(stderr, "Unable to open \"%s\" in write-binary\n",
+                            otp_file_name);
+                    fclose(input_file);
+                    exit(EXIT_FAILURE);
+                } else {
+                    fprintf(verbose_printer,
+                            "debug: opened file - \"%s\" in write-binary\n",
+                            otp_file_name);
+                }
+            }
+
+            // a pad store opens the output itself, once it knows it has the pad for it
+            if (pad_store_name != NULL) {
+                encrypt_store(input_file, output_file_name, pad_store_name);
                 fclose(input_file);
-                exit(EXIT_FAILURE);
-            } else {
-                fprintf(verbose_printer,
-                        "debug: opened file - \"%s\" in write-binary\n",
-                        otp_file_name);
+                break;
             }
 
             // open output-file for writing
-            output_file = fopen("output.txt", "wb");
+            output_file = strcmp(output_file_name, "-") == 0
+                          ? stdout : fopen(output_file_name, write_mode);
             if (output_file == NULL) {
-                fprintf(stderr,
-                        "Unable to open \"output.txt\" in write-binary\n");
+                fprintf(stderr, "Unable to open \"%s\" in write-binary\n",
+                        output_file_name);
                 fclose(input_file);
                 fclose(otp_file);
                 exit(EXIT_FAILURE);
             } else {
                 fprintf(verbose_printer,
-                        "debug: opened file - \"output.txt\" in write-binary\n");
+                        "debug: opened file - \"%s\" in write-binary\n",
+                        output_file_name);
             }
 
-            encrypt(input_file, output_file, otp_file);
+            if (use_auth) {
+                if (use_uring)
+                    fprintf(verbose_printer, "debug: --auth hashes in the stdio pipeline\n");
+                pad_pool *pool = pad_pool_dir != NULL ? pad_pool_open(pad_pool_dir) : NULL;
+                encrypt_auth(input_file, output_file, otp_file, pool);
+                if (pool != NULL)
+                    pad_pool_close(pool);
+            } else if (!use_uring || !encrypt_uring(input_file, output_file, otp_file)) {
+                if (use_uring)
+                    fprintf(verbose_printer,
+                            "debug: io_uring or regular files unavailable, using stdio\n");
+                pad_pool *pool = pad_pool_dir != NULL ? pad_pool_open(pad_pool_dir) : NULL;
+                if (checkpoint_name != NULL)
+                    encrypt_checkpointed(input_file, output_file, otp_file, pool, checkpoint_name,
+                                         use_resume);
+                else if (pool != NULL)
+                    encrypt_pool(input_file, output_file, otp_file, pool);
+                else
+                    encrypt(input_file, output_file, otp_file);
+                if (pool != NULL)
+                    pad_pool_close(pool);
+            }
+            free(checkpoint_name);
 
             // close file connections
             fclose(input_file);
-            fclose(otp_file);
+            if (otp_file != NULL)
+                fclose(otp_file);
             fclose(output_file);
             break;
         case OTP_DECRYPT:
+            if (otp_file_name == NULL) {
+                fprintf(stderr, "-d requires the one-time-pad to be given with -p\n");
+                exit(EXIT_FAILURE);
+            }
+
+            if (use_mmap + use_uring + use_parallel > 1) {
+                fprintf(stderr, "--mmap, --io-uring and --parallel can not be combined\n");
+                exit(EXIT_FAILURE);
+            }
+
+            if (use_in_place) {
+                if (strcmp(input_file_name, "-") == 0 || output_file_name != NULL || use_range) {
+                    fprintf(stderr, "--in-place needs a named input and no -o or --range\n");
+                    exit(EXIT_FAILURE);
+                }
+                xor_in_place(input_file_name, otp_file_name, false, verbose_printer);
+                break;
+            }
+
             // open requested input file
-            input_file = fopen(input_file_name, "rb");
+            input_file = strcmp(input_file_name, "-") == 0
+                         ? stdin : fopen(input_file_name, "rb");
             if (input_file == NULL) {
                 fprintf(stderr, "%s is an invalid file name\n",
                         input_file_name);
@@ -226,158 +533,130 @@ int main(int argc, char* argv[argc]) {
                         otp_file_name);
             }
 
-            // open output-file for writing
-            output_file = fopen("decrypt_output.txt", "wb");
+            if (use_range && !is_pad_store(otp_file)) {
+                fprintf(stderr, "--range needs a cipher text encrypted with --pad-store\n");
+                exit(EXIT_FAILURE);
+            }
+
+            // open output-file for writing, mappings also need read access
+            if (output_file_name == NULL)
+                output_file_name = "decrypt_output.txt";
+            output_file = strcmp(output_file_name, "-") == 0
+                          ? stdout : fopen(output_file_name, use_mmap ? "w+b" : "wb");
             if (output_file == NULL) {
-                fprintf(stderr,
-                        "Unable to open \"decrypt_output.txt\" in write-binary\n");
+                fprintf(stderr, "Unable to open \"%s\" in write-binary\n",
+                        output_file_name);
                 fclose(input_file);
                 fclose(otp_file);
                 exit(EXIT_FAILURE);
             } else {
                 fprintf(verbose_printer,
-                        "debug: opened file - \"decrypt_output.txt\" in write-binary\n");
+                        "debug: opened file - \"%s\" in write-binary\n",
+                        output_file_name);
             }
 
-            decrypt(input_file, output_file, otp_file);
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            if (use_range) {
+                decrypt_store_range(input_file, output_file, otp_file, range_offset, range_len);
+            } else if (is_pad_store(otp_file)) {
+                if (use_mmap || use_uring || use_parallel)
+                    fprintf(verbose_printer, "debug: decrypting from a pad store, using stdio\n");
+                decrypt_store(input_file, output_file, otp_file);
+            } else if (use_auth || is_authenticated(input_file, otp_file)) {
+                if (use_mmap || use_uring || use_parallel)
+                    fprintf(verbose_printer, "debug: checking the MAC tag, using stdio\n");
+                decrypt_auth(input_file, output_file, otp_file);
+            } else if (use_mmap)
+                decrypt_mmap(input_file, output_file, otp_file);
+            else if (use_parallel && decrypt_parallel(input_file, output_file, otp_file)) {
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                double seconds = (double) (end.tv_sec - start.tv_sec)
+                                 + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+                off_t size = fsize(input_file);
+                fprintf(verbose_printer,
+                        "debug: decrypted %lld bytes on %d threads in %.3f s (%.1f MB/s)\n",
+                        (long long) size, omp_get_max_threads(), seconds,
+                        (double) size / seconds / 1e6);
+            } else if (!use_uring || !decrypt_uring(input_file, output_file, otp_file)) {
+                if (use_uring || use_parallel)
+                    fprintf(verbose_printer,
+                            "debug: io_uring or regular files unavailable, using stdio\n");
+                decrypt(input_file, output_file, otp_file);
+            }
             fclose(input_file);
             fclose(otp_file);
             fclose(output_file);
+            break;
+        case OTP_BATCH_ENCRYPT:
+        case OTP_BATCH_DECRYPT:
+            if (program_mode == OTP_BATCH_ENCRYPT)
+                fprintf(verbose_printer, "debug: using the %s pad engine\n", pad_engine_init());
+
+            // the remaining arguments are the files of the batch
+            for (; argc > 1; --argc, ++argv) {
+                batch_files = realloc(batch_files, (batch_count + 1) * sizeof(char *));
+                if (batch_files == NULL) {
+                    fprintf(stderr, "fatal: out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                batch_files[batch_count++] = argv[1];
+            }
+
+            size_t failures = batch_run(program_mode == OTP_BATCH_ENCRYPT,
+                                        batch_files, batch_count);
+            fprintf(verbose_printer, "debug: batch processed %zu of %zu files\n",
+                    batch_count - failures, batch_count);
+            if (failures)
+                status = EXIT_FAILURE;
+            free(batch_files);
+            break;
+        case OTP_DIR_ENCRYPT:
+        case OTP_DIR_DECRYPT:
+            if (program_mode == OTP_DIR_ENCRYPT)
+                fprintf(verbose_printer, "debug: using the %s pad engine\n", pad_engine_init());
+            if (output_file_name != NULL && strcmp(output_file_name, "-") == 0) {
+                fprintf(stderr, "a directory can not be written to stdout\n");
+                exit(EXIT_FAILURE);
+            }
+
+            // "dir/" names the same tree as "dir", but not for the default names
+            char *dir_name = concat(input_file_name, "");
+            for (size_t len = strlen(dir_name); len > 1 && dir_name[len - 1] == '/';)
+                dir_name[--len] = '\0';
+
+            char *base = strip_cipher_suffix(dir_name);
+            char *default_output = program_mode == OTP_DIR_ENCRYPT
+                                   ? concat(dir_name, BATCH_CIPHER_SUFFIX)
+                                   : concat(base, strcmp(base, dir_name) == 0 ? ".dec" : "");
+            char *default_pad = concat(base, BATCH_PAD_SUFFIX);
+            if (output_file_name == NULL)
+                output_file_name = default_output;
+            if (otp_file_name == NULL)
+                otp_file_name = default_pad;
+
+            size_t dir_failures = program_mode == OTP_DIR_ENCRYPT
+                                  ? dir_encrypt(dir_name, output_file_name, otp_file_name, pack_pads)
+                                  : dir_decrypt(dir_name, output_file_name, otp_file_name);
+            fprintf(verbose_printer, "debug: \"%s\" -> \"%s\" with pads at \"%s\", %zu failures\n",
+                    dir_name, output_file_name, otp_file_name, dir_failures);
+            if (dir_failures)
+                status = EXIT_FAILURE;
+
+            free(dir_name);
+            free(base);
+            free(default_output);
+            free(default_pad);
+            break;
         default:
             break;
     }
 
     if (!verbose_print)
         fclose(verbose_printer);
-}
-
-
-void encrypt(FILE* plain_text, FILE* ouput, FILE* otp) {
-    // Error check the input files
-    long cipher_size = fsize(plain_text);
-    if (cipher_size <= 0) {
-        invalid_file_size(plain_text->);
-    }
-
-    ldiv_t blocks_r = ldiv(cipher_size, ULL_SIZE);
-
-    char_container one_time_pad;
-    char_container cipher_pad = {.ull = 0ULL};
-
-    /* Core encryption loop
-     * - Reads in ULL_SIZE bytes from Intel rdrand64
-     * - Reads in ULL_SIZE bytes from the plain_text into cipher_pad
-     * - XORs the bytes against each other and store them back into cipher_pad
-     * - Writes the bytes out one byte at a time
-     */
-    for (long i = 0; i < blocks_r.quot; ++i)
-    {
-        // generate 64-bits (8 bytes) of random bits
-        if(!_rdrand64_step(&one_time_pad.ull))
-        {
-            fprintf(stderr, "failed to read from sysrand\n");
-            exit(3);
-        }
-
-        // read in file data
-        fwrite(one_time_pad.c, sizeof(char), ULL_SIZE, otp);
-        fread(cipher_pad.c, sizeof(char), ULL_SIZE, plain_text);
-
-        // XOR and write out encrypted data
-        cipher_pad.ull ^= one_time_pad.ull;
-        fwrite(cipher_pad.c, sizeof(char), ULL_SIZE, ouput);
-    }
-
-    // handle remaining bytes using the same logic as above
-    if (blocks_r.rem)
-    {
-        size_t remain = (size_t) blocks_r.rem;
-        printf("debug: handling a remaining %zu bytes\n", remain);
-
-        if(!_rdrand64_step(&one_time_pad.ull))
-        {
-            fprintf(stderr, "failed to read from sysrand\n");
-            exit(3);
-        }
-
-        fwrite(one_time_pad.c, sizeof(char), remain, otp);
-        fread(cipher_pad.c, sizeof(char), remain, plain_text);
-        cipher_pad.ull ^= one_time_pad.ull;
-        fwrite(cipher_pad.c, sizeof(char), remain, ouput);
-    }
-}
-
 
-void decrypt(FILE* cipher_text, FILE* output, FILE* otp) {
-    /* - Check that the cipher text has a valid file size.
-     * - Check that the one-time-pad has a valid file size
-     * - Verify that the one-time-pad is the same length as the cipher text.
-     */
-    long cipher_size = fsize(cipher_text);
-    if (cipher_size <= 0)
-        invalid_file_size("cipher text");
-
-    long otp_size = fsize(otp);
-    if (otp_size <= 0)
-        invalid_file_size("one-time-pad");
-
-    if (cipher_size != otp_size)
-        size_missmatch();
-
-    ldiv_t blocks_r = ldiv(cipher_size, ULL_SIZE);
-    char_container one_time_pad = {0}, cipher_pad = {0};
-
-    /* Core decryption loop
-     * - Reads in ULL_SIZE bytes from the one-time-pad
-     * - Reads in ULL_SIZE bytes from the cipher_text
-     * - XORs the bytes against each-other and stores them back into cipher_pad
-     * - Writes the bytes out one byte at a time
-     */
-    for (long i = 0; i < blocks_r.quot; ++i)
-    {
-        fread(one_time_pad.c, sizeof(char), ULL_SIZE, otp);
-        fread(cipher_pad.c, sizeof(char), ULL_SIZE, cipher_text);
-
-        cipher_pad.ull ^= one_time_pad.ull;
-        fwrite(cipher_pad.c, sizeof(char), ULL_SIZE, output);
-    }
-
-    // handle remaining text using the same logic as the Core decryption loop.
-    if (blocks_r.rem)
-    {
-        size_t remain = (size_t) blocks_r.rem;
-        fread(one_time_pad.c, sizeof(char), remain, otp);
-        fread(cipher_pad.c, sizeof(char), remain, cipher_text);
-
-        cipher_pad.ull ^= one_time_pad.ull;
-        fwrite(cipher_pad.c, sizeof(char), remain, output);
-    }
-}
-
-
-long
-fsize(FILE *fp)
-{
-    long prev = ftell(fp);
-    fseek(fp, 0L, SEEK_END);
-
-    long sz = ftell(fp);
-    fseek(fp, prev, SEEK_SET); //go back to where we were
-
-    return sz;
-}
-
-
-noreturn void invalid_file_size(const char *str)
-{
-    fprintf(stderr, "fatal: invalid file size \"%s\"(greater than 2GiB or empty file)\n", str);
-    exit(2);
-}
-
-
-noreturn void size_missmatch(void)
-{
-    fprintf(stderr, "fatal: size mismatch during decryption\n");
-    fprintf(stderr, "       cipher text length does not equal the length of the one-time-pad\n");
-    exit(3);
+    if (status == EXIT_SUCCESS)
+        stats_complete();
+    return status;
 }
@@ -0,0 +1,1205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <omp.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "otp.h"
+
+
+/**
+ * Stages of the encryption pipeline, in the order a block passes through them.
+ * The pad fill and the XOR share a stage so the pad is XORed while it is
+ * still in cache.
+ */
+typedef enum {
+    STAGE_READ, STAGE_PAD, STAGE_WRITE_PAD, STAGE_WRITE_CIPHER, STAGE_COUNT
+} E_PIPELINE_STAGE;
+
+
+/**
+ * A reusable block of the encryption ring, \p data holds the plain text and
+ * is XORed in place into the cipher text.
+ */
+typedef struct {
+    unsigned char *data;
+    unsigned char *pad;
+    size_t len;
+    E_PIPELINE_STAGE stage;     // the stage that may work on the block next
+    bool interval_end;          // a checkpoint is due once the block is written
+    uint32_t pad_crc;           // of the interval the block ends
+} pipeline_block;
+
+
+typedef struct {
+    pipeline_block blocks[PIPELINE_DEPTH];
+    size_t block_size;
+    int threads;                // the pad team, the pad stage does not inherit --threads
+    mtx_t lock;
+    cnd_t changed;
+    FILE *plain_text, *output, *otp;
+    off_t total;
+    pad_pool *pool;             // where the pad comes from, NULL for pad_fill()
+    size_t pool_hint;
+    bool pool_dry;
+    otp_mac *mac;               // fed the cipher text in order, NULL without --auth
+    checkpoint *ckpt;           // NULL unless checkpoints are taken
+    const char *ckpt_path;
+    uint64_t pad_end, cipher_end;       // bytes written by each writer
+    uint32_t pad_crc, cipher_crc;       // of the current interval
+    int splice_fd;              // the cipher text pipe with --zero-copy, -1 otherwise
+    output_writer writers[2];   // the pad and the cipher text, in stage order
+} pipeline;
+
+
+typedef struct {
+    pipeline *p;
+    E_PIPELINE_STAGE stage;
+} pipeline_worker_arg;
+
+
+/**
+ * Returns true if \p fp refers to a regular file.
+ */
+static bool
+is_regular(FILE *fp)
+{
+    struct stat st;
+    return fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+
+/**
+ * Makes everything up to \p end durable and records it in a new checkpoint.
+ * Runs on the cipher text writer, which only sees a block after the pad writer.
+ */
+static void
+pipeline_checkpoint(pipeline *p, uint32_t pad_crc)
+{
+    // the pad writer may already be further along, which the checkpoint ignores
+    stat_timer t = stats_start();
+    if (fflush(p->output) != 0 || fflush(p->otp) != 0
+        || fdatasync(fileno(p->output)) != 0 || fdatasync(fileno(p->otp)) != 0) {
+        fprintf(stderr, "fatal: unable to flush the output for a checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    stats_stop(STAT_WRITE, t);
+
+    checkpoint *c = p->ckpt;
+    c->intervals = realloc(c->intervals, (c->count + 1) * sizeof(checkpoint_interval));
+    if (c->intervals == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    c->intervals[c->count++] = (checkpoint_interval) {
+        .end = p->cipher_end, .cipher_crc = p->cipher_crc, .pad_crc = pad_crc,
+    };
+    c->offset = c->pad_offset = p->cipher_end;
+    p->cipher_crc = 0;
+    checkpoint_write(p->ckpt_path, c);
+}
+
+
+/**
+ * Keeps the CRC32C of the current interval for the writer \p stage and takes
+ * a checkpoint once the cipher text writer finishes an interval. The pad
+ * writer decides where intervals end, the cipher text writer follows it.
+ */
+static void
+pipeline_track(pipeline *p, E_PIPELINE_STAGE stage, pipeline_block *b)
+{
+    stat_timer t = stats_start();
+    if (stage == STAGE_WRITE_PAD) {
+        p->pad_crc = crc32c(p->pad_crc, b->pad, b->len);
+        uint64_t start = p->pad_end;
+        p->pad_end += b->len;
+        b->interval_end = start / CHECKPOINT_INTERVAL != p->pad_end / CHECKPOINT_INTERVAL;
+        if (b->interval_end) {
+            b->pad_crc = p->pad_crc;
+            p->pad_crc = 0;
+        }
+    } else {
+        p->cipher_crc = crc32c(p->cipher_crc, b->data, b->len);
+        p->cipher_end += b->len;
+    }
+    stats_stop(STAT_CRC, t);
+
+    if (stage == STAGE_WRITE_CIPHER && b->interval_end)
+        pipeline_checkpoint(p, b->pad_crc);
+}
+
+
+/**
+ * Runs \p stage on a single block.
+ * @returns true once the end of the plain text has passed through the stage.
+ */
+static bool
+pipeline_run_stage(pipeline *p, E_PIPELINE_STAGE stage, pipeline_block *b)
+{
+    if (stage == STAGE_READ) {
+        stat_timer t = stats_start();
+        b->len = fread(b->data, sizeof(char), p->block_size, p->plain_text);
+        // pages still being read ahead are skipped, so the block before is dropped again
+        off_t behind = p->total > (off_t) p->block_size ? p->total - (off_t) p->block_size : 0;
+        input_drop(p->plain_text, behind, (size_t) (p->total - behind) + b->len);
+        stats_stop(STAT_READ, t);
+        stats_add(STAT_BYTES, b->len);
+        p->total += (off_t) b->len;
+        return b->len == 0;
+    }
+
+    // an empty block marks the end of the plain text
+    if (b->len == 0)
+        return true;
+
+    switch (stage) {
+        case STAGE_PAD: {
+            size_t n = 0;
+            if (p->pool != NULL && !p->pool_dry) {
+                stat_timer t = stats_start();
+                n = pad_pool_take(p->pool, b->pad, b->len, p->pool_hint);
+                stats_stop(STAT_PAD, t);
+                stats_add(STAT_POOL_BYTES, n);
+
+                t = stats_start();
+                xor_buffer(b->data, b->data, b->pad, n);
+                stats_stop(STAT_XOR, t);
+
+                if (n < b->len) {
+                    fprintf(stderr, "warning: the pad pool ran dry, generating the rest inline\n");
+                    p->pool_dry = true;
+                }
+            }
+            if (n < b->len)
+                pad_xor_block(b->data + n, b->pad + n, b->len - n, p->threads);
+
+            // blocks pass this stage in order, so the hash sees the cipher text in order
+            if (p->mac != NULL)
+                mac_update(p->mac, b->data, b->len);
+            break;
+        }
+        case STAGE_WRITE_PAD:
+        case STAGE_WRITE_CIPHER: {
+            unsigned char *buf = stage == STAGE_WRITE_PAD ? b->pad : b->data;
+            stat_timer t = stats_start();
+            bool written = stage == STAGE_WRITE_CIPHER && p->splice_fd >= 0
+                           ? vmsplice_full(p->splice_fd, buf, b->len)
+                           : output_write(&p->writers[stage - STAGE_WRITE_PAD], buf, b->len);
+            if (!written)
+            {
+                fprintf(stderr, "fatal: write error during encryption\n");
+                exit(EXIT_FAILURE);
+            }
+            stats_stop(STAT_WRITE, t);
+
+            if (p->ckpt != NULL)
+                pipeline_track(p, stage, b);
+            break;
+        }
+        default:
+            break;
+    }
+
+    return false;
+}
+
+
+/**
+ * Thread body for one pipeline stage. Walks the ring in order, waiting for
+ * each block to be handed over by the previous stage.
+ */
+static int
+pipeline_worker(void *arg)
+{
+    pipeline_worker_arg *a = arg;
+    pipeline *p = a->p;
+    pipeline_block *held = NULL;
+
+    for (size_t seq = 0;; ++seq)
+    {
+        pipeline_block *b = &p->blocks[seq % PIPELINE_DEPTH];
+
+        mtx_lock(&p->lock);
+        while (b->stage != a->stage)
+            cnd_wait(&p->changed, &p->lock);
+        mtx_unlock(&p->lock);
+
+        bool last = pipeline_run_stage(p, a->stage, b);
+
+        /* A block spliced into the pipe may still be unread, it goes back to
+         * the reader only once the next whole block has been spliced after it,
+         * see zero_copy_open(). */
+        mtx_lock(&p->lock);
+        if (held != NULL)
+            held->stage = STAGE_READ;
+        held = NULL;
+        if (a->stage == STAGE_WRITE_CIPHER && p->splice_fd >= 0 && !last)
+            held = b;
+        else
+            b->stage = (a->stage + 1) % STAGE_COUNT;
+        cnd_broadcast(&p->changed);
+        mtx_unlock(&p->lock);
+
+        if (last)
+            return 0;
+    }
+}
+
+
+/**
+ * Runs the encryption pipeline, see encrypt().
+ */
+static void
+encrypt_pipeline(FILE* plain_text, FILE* output, FILE* otp, pad_pool *pool, otp_mac *mac,
+                 checkpoint *ckpt, const char *ckpt_path)
+{
+    /* Core encryption pipeline
+     * - A reader thread fills blocks from the plain_text
+     * - A pad thread fills each block's pad from the selected pad engine with
+     *   an OpenMP team and XORs it into the block
+     * - Two writer threads write out the pad and the encrypted data in order
+     * PIPELINE_DEPTH blocks circulate between the stages, so reading, pad
+     * generation and both writes overlap.
+     */
+    pipeline p = {
+        .threads = omp_get_max_threads(),
+        .plain_text = plain_text, .output = output, .otp = otp, .pool = pool, .mac = mac,
+        .ckpt = ckpt, .ckpt_path = ckpt_path,
+    };
+    p.block_size = PAD_BLOCK_SIZE * (size_t) p.threads;
+    p.splice_fd = zero_copy_open(output, p.block_size);
+
+    // a resumed encryption continues after its checkpoint
+    if (ckpt != NULL) {
+        p.total = (off_t) ckpt->offset;
+        p.pad_end = p.cipher_end = ckpt->offset;
+    }
+
+    // a regular file's pad is reserved from the pool in one go, and its outputs on disk
+    struct stat st;
+    off_t remaining = 0;
+    if (fstat(fileno(plain_text), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > p.total)
+        remaining = st.st_size - p.total;
+    if (pool != NULL)
+        p.pool_hint = (size_t) remaining;
+    input_advise(plain_text);
+    output_open(&p.writers[0], otp, remaining);
+    output_open(&p.writers[1], output, remaining);
+
+    size_t alignment = output_buffer_alignment();
+    for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+        p.blocks[i].data = p.splice_fd >= 0 ? page_alloc(p.block_size)
+                                            : aligned_alloc(alignment, p.block_size);
+        p.blocks[i].pad = aligned_alloc(alignment, p.block_size);
+        p.blocks[i].stage = STAGE_READ;
+        if (p.blocks[i].data == NULL || p.blocks[i].pad == NULL) {
+            fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (mtx_init(&p.lock, mtx_plain) != thrd_success
+        || cnd_init(&p.changed) != thrd_success) {
+        fprintf(stderr, "fatal: unable to set up the encryption pipeline\n");
+        exit(EXIT_FAILURE);
+    }
+
+    thrd_t workers[STAGE_COUNT];
+    pipeline_worker_arg args[STAGE_COUNT];
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        args[s] = (pipeline_worker_arg) {.p = &p, .stage = (E_PIPELINE_STAGE) s};
+        if (thrd_create(&workers[s], pipeline_worker, &args[s]) != thrd_success) {
+            fprintf(stderr, "fatal: unable to start the encryption pipeline\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int s = 0; s < STAGE_COUNT; ++s)
+        thrd_join(workers[s], NULL);
+
+    if (!output_close(&p.writers[0]) || !output_close(&p.writers[1])) {
+        fprintf(stderr, "fatal: write error during encryption\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cnd_destroy(&p.changed);
+    mtx_destroy(&p.lock);
+    for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+        if (p.splice_fd >= 0)
+            page_free(p.blocks[i].data, p.block_size);
+        else
+            free(p.blocks[i].data);
+        free(p.blocks[i].pad);
+    }
+
+    // the plain text may be a pipe, so an empty input is only known at the end
+    if (p.total == 0)
+        invalid_file_size("plain text");
+}
+
+
+void encrypt(FILE* plain_text, FILE* output, FILE* otp) {
+    encrypt_pipeline(plain_text, output, otp, NULL, NULL, NULL, NULL);
+}
+
+
+void
+encrypt_pool(FILE* plain_text, FILE* output, FILE* otp, pad_pool *pool)
+{
+    encrypt_pipeline(plain_text, output, otp, pool, NULL, NULL, NULL);
+}
+
+
+/**
+ * Cuts \p output and \p otp back to the checkpoint \p c and checks its
+ * last interval, the one written just before the checkpoint was taken.
+ */
+static void
+checkpoint_restore(FILE* output, FILE* otp, const checkpoint *c)
+{
+    if (fsize(output) < (off_t) c->offset || fsize(otp) < (off_t) c->pad_offset)
+        size_missmatch();
+
+    // whatever was written after the checkpoint is written again
+    if (ftruncate(fileno(output), (off_t) c->offset) != 0
+        || ftruncate(fileno(otp), (off_t) c->pad_offset) != 0) {
+        fprintf(stderr, "fatal: unable to cut the output back to its checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    if (c->count == 0)
+        return;
+
+    const checkpoint_interval *last = &c->intervals[c->count - 1];
+    uint64_t start = c->count > 1 ? c->intervals[c->count - 2].end : 0;
+    unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, PAD_BLOCK_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t cipher_crc = 0, pad_crc = 0;
+    for (uint64_t at = start; at < last->end;) {
+        size_t n = last->end - at < PAD_BLOCK_SIZE ? (size_t) (last->end - at) : PAD_BLOCK_SIZE;
+        if (!pread_full(fileno(output), buf, n, (off_t) at))
+            size_missmatch();
+        cipher_crc = crc32c(cipher_crc, buf, n);
+        if (!pread_full(fileno(otp), buf, n, (off_t) at))
+            size_missmatch();
+        pad_crc = crc32c(pad_crc, buf, n);
+        at += n;
+    }
+    free(buf);
+
+    if (cipher_crc != last->cipher_crc || pad_crc != last->pad_crc) {
+        fprintf(stderr, "fatal: the output or one-time-pad does not match its checkpoint\n");
+        exit(3);
+    }
+}
+
+
+void
+encrypt_checkpointed(FILE* plain_text, FILE* output, FILE* otp, pad_pool *pool,
+                     const char *state_path, bool resume)
+{
+    struct stat st;
+    if (fstat(fileno(plain_text), &st) != 0 || !S_ISREG(st.st_mode)
+        || !is_regular(output) || !is_regular(otp)) {
+        if (resume) {
+            fprintf(stderr, "--resume needs the plain text, output and one-time-pad to be regular files\n");
+            exit(EXIT_FAILURE);
+        }
+        encrypt_pipeline(plain_text, output, otp, pool, NULL, NULL, NULL);
+        return;
+    }
+
+    checkpoint c = {
+        .plain_size = (uint64_t) st.st_size,
+        .plain_mtime_sec = st.st_mtim.tv_sec, .plain_mtime_nsec = st.st_mtim.tv_nsec,
+    };
+    if (resume) {
+        checkpoint saved;
+        if (!checkpoint_read(state_path, &saved)) {
+            fprintf(stderr, "fatal: there is no checkpoint at \"%s\"\n", state_path);
+            exit(EXIT_FAILURE);
+        }
+        if (saved.plain_size != c.plain_size || saved.plain_mtime_sec != c.plain_mtime_sec
+            || saved.plain_mtime_nsec != c.plain_mtime_nsec) {
+            fprintf(stderr, "fatal: the plain text changed since \"%s\" was taken\n", state_path);
+            exit(EXIT_FAILURE);
+        }
+
+        checkpoint_restore(output, otp, &saved);
+        c = saved;
+        if (fseeko(plain_text, (off_t) c.offset, SEEK_SET) != 0
+            || fseeko(output, (off_t) c.offset, SEEK_SET) != 0
+            || fseeko(otp, (off_t) c.pad_offset, SEEK_SET) != 0) {
+            fprintf(stderr, "fatal: unable to seek to the checkpoint\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    encrypt_pipeline(plain_text, output, otp, pool, NULL, &c, state_path);
+    free(c.intervals);
+
+    // a finished encryption has nothing to resume
+    if (unlink(state_path) != 0 && errno != ENOENT)
+        fprintf(stderr, "warning: unable to remove the checkpoint \"%s\"\n", state_path);
+}
+
+
+void
+encrypt_auth(FILE* plain_text, FILE* output, FILE* otp, pad_pool *pool)
+{
+    // the key is needed from the first block on but goes after the pad it protects
+    unsigned char key[MAC_KEY_SIZE], tag[MAC_TAG_SIZE];
+    if (!pad_fill(key, sizeof(key))) {
+        fprintf(stderr, "failed to read from sysrand\n");
+        exit(3);
+    }
+
+    otp_mac mac;
+    mac_init(&mac, key);
+    encrypt_pipeline(plain_text, output, otp, pool, &mac, NULL, NULL);
+    mac_final(&mac, tag);
+
+    if (fwrite(key, sizeof(char), sizeof(key), otp) != sizeof(key)
+        || fwrite(tag, sizeof(char), sizeof(tag), output) != sizeof(tag)) {
+        fprintf(stderr, "fatal: write error during encryption\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(key, 0, sizeof(key));
+}
+
+
+void decrypt(FILE* cipher_text, FILE* output, FILE* otp) {
+    /* - Check that the one-time-pad has a valid file size
+     * - Verify that the one-time-pad is the same length as the cipher text,
+     *   which for a piped cipher text is only known once it runs dry.
+     */
+    off_t otp_size = fsize(otp);
+    if (otp_size <= 0)
+        invalid_file_size("one-time-pad");
+
+    struct stat st;
+    if (fstat(fileno(cipher_text), &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_size != otp_size)
+        size_missmatch();
+
+    /* With --zero-copy the plain text is spliced into the output pipe, from
+     * two buffers taking turns so the reader has a whole block spliced after
+     * one before it is filled again, see zero_copy_open(). */
+    int splice_fd = zero_copy_open(output, PAD_BLOCK_SIZE);
+    unsigned char *cipher_bufs[2] = {NULL, NULL};
+    for (int i = 0; i < (splice_fd >= 0 ? 2 : 1); ++i)
+        cipher_bufs[i] = splice_fd >= 0 ? page_alloc(PAD_BLOCK_SIZE)
+                                        : aligned_alloc(PAD_ALIGNMENT, PAD_BLOCK_SIZE);
+    unsigned char *pad_buf = aligned_alloc(PAD_ALIGNMENT, PAD_BLOCK_SIZE);
+    if (cipher_bufs[0] == NULL || (splice_fd >= 0 && cipher_bufs[1] == NULL) || pad_buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Core decryption loop
+     * - Reads in up to PAD_BLOCK_SIZE bytes from the one-time-pad
+     * - Reads in the same number of bytes from the cipher_text
+     * - XORs the pad into the cipher text buffer
+     * - Writes out the decrypted block
+     */
+    size_t n;
+    unsigned char *cipher_buf = cipher_bufs[0];
+    stat_timer t = stats_start();
+    for (int turn = 0; (n = fread(pad_buf, sizeof(char), PAD_BLOCK_SIZE, otp)) > 0; ++turn)
+    {
+        if (splice_fd >= 0)
+            cipher_buf = cipher_bufs[turn % 2];
+
+        if (fread(cipher_buf, sizeof(char), n, cipher_text) != n)
+            size_missmatch();
+        stats_stop(STAT_READ, t);
+        stats_add(STAT_BYTES, n);
+
+        t = stats_start();
+        xor_buffer(cipher_buf, cipher_buf, pad_buf, n);
+        stats_stop(STAT_XOR, t);
+
+        t = stats_start();
+        bool written = splice_fd >= 0 ? vmsplice_full(splice_fd, cipher_buf, n)
+                                      : fwrite(cipher_buf, sizeof(char), n, output) == n;
+        if (!written)
+        {
+            fprintf(stderr, "fatal: write error during decryption\n");
+            exit(EXIT_FAILURE);
+        }
+        stats_stop(STAT_WRITE, t);
+
+        t = stats_start();
+    }
+
+    // the pad ran out, so the cipher text has to be exhausted as well
+    if (fgetc(cipher_text) != EOF)
+        size_missmatch();
+
+    for (int i = 0; i < 2; ++i) {
+        if (splice_fd >= 0)
+            page_free(cipher_bufs[i], PAD_BLOCK_SIZE);
+        else
+            free(cipher_bufs[i]);
+    }
+    free(pad_buf);
+}
+
+
+void
+decrypt_auth(FILE* cipher_text, FILE* output, FILE* otp)
+{
+    // the pad is the plain text's pad followed by the MAC key
+    off_t otp_size = fsize(otp);
+    if (otp_size <= MAC_KEY_SIZE)
+        invalid_file_size("one-time-pad");
+    off_t len = otp_size - MAC_KEY_SIZE;
+
+    struct stat st;
+    if (fstat(fileno(cipher_text), &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_size != len + MAC_TAG_SIZE)
+        size_missmatch();
+
+    unsigned char key[MAC_KEY_SIZE], tag[MAC_TAG_SIZE];
+    if (!pread_full(fileno(otp), key, sizeof(key), len)) {
+        fprintf(stderr, "fatal: unable to read the MAC key from the one-time-pad\n");
+        exit(EXIT_FAILURE);
+    }
+    otp_mac mac;
+    mac_init(&mac, key);
+    memset(key, 0, sizeof(key));
+
+    unsigned char *cipher_buf = aligned_alloc(PAD_ALIGNMENT, PAD_BLOCK_SIZE);
+    unsigned char *pad_buf = aligned_alloc(PAD_ALIGNMENT, PAD_BLOCK_SIZE);
+    if (cipher_buf == NULL || pad_buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // like decrypt(), but hashing each block of cipher text before it is XORed
+    for (off_t done = 0; done < len;) {
+        size_t n = len - done < (off_t) PAD_BLOCK_SIZE ? (size_t) (len - done) : PAD_BLOCK_SIZE;
+        stat_timer t = stats_start();
+        if (fread(pad_buf, sizeof(char), n, otp) != n)
+            invalid_file_size("one-time-pad");
+        if (fread(cipher_buf, sizeof(char), n, cipher_text) != n)
+            size_missmatch();
+        stats_stop(STAT_READ, t);
+        stats_add(STAT_BYTES, n);
+
+        mac_update(&mac, cipher_buf, n);
+
+        t = stats_start();
+        xor_buffer(cipher_buf, cipher_buf, pad_buf, n);
+        stats_stop(STAT_XOR, t);
+
+        t = stats_start();
+        if (fwrite(cipher_buf, sizeof(char), n, output) != n)
+        {
+            fprintf(stderr, "fatal: write error during decryption\n");
+            exit(EXIT_FAILURE);
+        }
+        stats_stop(STAT_WRITE, t);
+        done += (off_t) n;
+    }
+
+    if (fread(tag, sizeof(char), sizeof(tag), cipher_text) != sizeof(tag)
+        || fgetc(cipher_text) != EOF)
+        size_missmatch();
+
+    if (!mac_verify(&mac, tag)) {
+        // leave nothing behind that could be mistaken for the plain text
+        fflush(output);
+        struct stat out_st;
+        if (fstat(fileno(output), &out_st) == 0 && S_ISREG(out_st.st_mode))
+            ftruncate(fileno(output), 0);
+        fprintf(stderr, "fatal: authentication failed during decryption\n");
+        fprintf(stderr, "       the cipher text or the one-time-pad has been modified\n");
+        exit(3);
+    }
+
+    free(cipher_buf);
+    free(pad_buf);
+}
+
+
+bool
+is_authenticated(FILE* cipher_text, FILE* otp)
+{
+    struct stat cipher_st, otp_st;
+    return fstat(fileno(cipher_text), &cipher_st) == 0 && S_ISREG(cipher_st.st_mode)
+           && fstat(fileno(otp), &otp_st) == 0
+           && otp_st.st_size == cipher_st.st_size + (MAC_KEY_SIZE - MAC_TAG_SIZE);
+}
+
+
+/**
+ * Maps \p len bytes of \p fd with the given protection and a sequential
+ * access hint, exiting on failure.
+ */
+static unsigned char *
+map_file(int fd, size_t len, int prot, const char *str)
+{
+    void *addr = mmap(NULL, len, prot, prot & PROT_WRITE ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "fatal: unable to map the %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+
+    stats_add(STAT_MMAPS, 1);
+    madvise(addr, len, MADV_SEQUENTIAL);
+    return addr;
+}
+
+
+void decrypt_mmap(FILE* cipher_text, FILE* output, FILE* otp) {
+    off_t cipher_size = fsize(cipher_text);
+    if (cipher_size <= 0)
+        invalid_file_size("cipher text");
+
+    off_t otp_size = fsize(otp);
+    if (otp_size <= 0)
+        invalid_file_size("one-time-pad");
+
+    if (cipher_size != otp_size)
+        size_missmatch();
+
+    if ((uintmax_t) cipher_size > SIZE_MAX) {
+        fprintf(stderr, "fatal: cipher text is too large to map on this platform\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // pre-size the output so the whole file can be mapped up front
+    size_t len = (size_t) cipher_size;
+    if (ftruncate(fileno(output), cipher_size) != 0) {
+        fprintf(stderr, "fatal: unable to resize the output file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char *cipher = map_file(fileno(cipher_text), len, PROT_READ, "cipher text");
+    unsigned char *pad = map_file(fileno(otp), len, PROT_READ, "one-time-pad");
+    unsigned char *out = map_file(fileno(output), len, PROT_READ | PROT_WRITE, "output file");
+
+    stat_timer t = stats_start();
+    xor_buffer(out, cipher, pad, len);
+    stats_stop(STAT_XOR, t);
+    stats_add(STAT_BYTES, len);
+
+    munmap(cipher, len);
+    munmap(pad, len);
+    munmap(out, len);
+}
+
+
+/**
+ * A minimal io_uring instance driven through the raw system calls.
+ */
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned to_submit;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+} uring;
+
+
+/**
+ * Operations a block can have in flight, encoded into the sqe user_data.
+ */
+enum {URING_READ_DATA, URING_READ_PAD, URING_WRITE_DATA, URING_WRITE_PAD, URING_OPS};
+
+
+/**
+ * A block of the io_uring backend, \p data is XORed in place with \p pad.
+ */
+typedef struct {
+    unsigned char *data;
+    unsigned char *pad;
+    off_t offset;
+    size_t len;
+    size_t done[URING_OPS];
+    int pending;
+    bool writing;
+    bool busy;
+} uring_slot;
+
+
+/**
+ * Sets up an io_uring instance with room for \p entries submissions.
+ * @returns false if the kernel does not provide io_uring.
+ */
+static bool
+uring_init(uring *r, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0)
+        return false;
+
+    r->sq_entries = params.sq_entries;
+    r->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels share a single mapping between both rings
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && r->cq_ring_len > r->sq_ring_len)
+        r->sq_ring_len = r->cq_ring_len;
+
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = single_mmap ? r->sq_ring
+                 : mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return false;
+    }
+
+    unsigned char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *) (sq + params.sq_off.head);
+    r->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + params.sq_off.array);
+    r->cq_head = (unsigned *) (cq + params.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+
+static void
+uring_close(uring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_len);
+    munmap(r->sq_ring, r->sq_ring_len);
+    close(r->fd);
+}
+
+
+/**
+ * Queues the next chunk of operation \p op for slot \p index, continuing
+ * after whatever part of the block has already completed.
+ */
+static void
+uring_queue(uring *r, uring_slot *slots, int index, int op, int fd, bool fixed)
+{
+    uring_slot *slot = &slots[index];
+    bool is_pad = op == URING_READ_PAD || op == URING_WRITE_PAD;
+    bool is_read = op == URING_READ_DATA || op == URING_READ_PAD;
+    unsigned char *buf = is_pad ? slot->pad : slot->data;
+
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    if (fixed)
+        sqe->opcode = is_read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+    else
+        sqe->opcode = is_read ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long) (uintptr_t) (buf + slot->done[op]);
+    sqe->len = (unsigned) (slot->len - slot->done[op]);
+    sqe->off = (unsigned long long) slot->offset + slot->done[op];
+    sqe->buf_index = (unsigned short) (index * 2 + is_pad);
+    sqe->user_data = (unsigned long long) index * URING_OPS + op;
+
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->to_submit;
+}
+
+
+/**
+ * Submits everything queued and waits for at least one completion.
+ */
+static void
+uring_submit_and_wait(uring *r)
+{
+    long ret;
+    stat_timer t = stats_start();
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_add(STAT_URING_ENTERS, 1);
+    } while (ret < 0 && errno == EINTR);
+    stats_stop(STAT_IO_WAIT, t);
+
+    if (ret < 0) {
+        fprintf(stderr, "fatal: io_uring submission failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    r->to_submit -= (unsigned) ret;
+}
+
+
+/**
+ * XORs \p size bytes of \p in_fd with a pad and writes the result to
+ * \p out_fd, keeping URING_DEPTH blocks of reads and writes in flight.
+ * The pad is read from \p pad_in_fd, or generated and written to
+ * \p pad_out_fd when \p pad_in_fd is -1.
+ */
+static void
+uring_xor_files(uring *r, int in_fd, int pad_in_fd, int out_fd, int pad_out_fd, off_t size)
+{
+    size_t block_size = PAD_BLOCK_SIZE * (size_t) omp_get_max_threads();
+    if (block_size > URING_MAX_BLOCK)
+        block_size = URING_MAX_BLOCK;
+
+    uring_slot slots[URING_DEPTH] = {0};
+    struct iovec iov[URING_DEPTH * 2];
+    for (int i = 0; i < URING_DEPTH; ++i) {
+        slots[i].data = aligned_alloc(PAD_ALIGNMENT, block_size);
+        slots[i].pad = aligned_alloc(PAD_ALIGNMENT, block_size);
+        if (slots[i].data == NULL || slots[i].pad == NULL) {
+            fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+            exit(EXIT_FAILURE);
+        }
+        iov[i * 2] = (struct iovec) {.iov_base = slots[i].data, .iov_len = block_size};
+        iov[i * 2 + 1] = (struct iovec) {.iov_base = slots[i].pad, .iov_len = block_size};
+    }
+
+    // registered buffers are an optimisation, a tight memlock limit only costs the fast path
+    bool fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                         iov, URING_DEPTH * 2) == 0;
+
+    off_t next = 0;
+    int busy = 0;
+    for (;;)
+    {
+        // start reading into every free slot
+        for (int i = 0; i < URING_DEPTH && next < size; ++i) {
+            if (slots[i].busy)
+                continue;
+
+            uring_slot *slot = &slots[i];
+            slot->offset = next;
+            slot->len = size - next < (off_t) block_size ? (size_t) (size - next) : block_size;
+            memset(slot->done, 0, sizeof(slot->done));
+            slot->writing = false;
+            slot->busy = true;
+            slot->pending = 1;
+            uring_queue(r, slots, i, URING_READ_DATA, in_fd, fixed);
+            if (pad_in_fd >= 0) {
+                uring_queue(r, slots, i, URING_READ_PAD, pad_in_fd, fixed);
+                ++slot->pending;
+            }
+
+            next += (off_t) slot->len;
+            ++busy;
+        }
+
+        if (busy == 0)
+            break;
+
+        uring_submit_and_wait(r);
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int index = (int) (cqe->user_data / URING_OPS);
+            int op = (int) (cqe->user_data % URING_OPS);
+            uring_slot *slot = &slots[index];
+            int fd = op == URING_READ_DATA ? in_fd : op == URING_READ_PAD ? pad_in_fd
+                     : op == URING_WRITE_DATA ? out_fd : pad_out_fd;
+
+            if (cqe->res < 0) {
+                fprintf(stderr, "fatal: io_uring %s failed: %s\n",
+                        slot->writing ? "write" : "read", strerror(-cqe->res));
+                exit(EXIT_FAILURE);
+            }
+            if (cqe->res == 0 && !slot->writing) {
+                fprintf(stderr, "fatal: input file shrank during processing\n");
+                exit(EXIT_FAILURE);
+            }
+            // a write that makes no progress would be resubmitted forever
+            if (cqe->res == 0) {
+                fprintf(stderr, "fatal: io_uring write made no progress\n");
+                exit(EXIT_FAILURE);
+            }
+
+            // short transfers are resubmitted for the remainder
+            slot->done[op] += (size_t) cqe->res;
+            if (slot->done[op] < slot->len) {
+                uring_queue(r, slots, index, op, fd, fixed);
+                continue;
+            }
+            if (--slot->pending > 0)
+                continue;
+
+            if (slot->writing) {
+                slot->busy = false;
+                --busy;
+                continue;
+            }
+
+            stats_add(STAT_BYTES, slot->len);
+            if (pad_in_fd >= 0) {
+                stat_timer t = stats_start();
+                xor_buffer(slot->data, slot->data, slot->pad, slot->len);
+                stats_stop(STAT_XOR, t);
+            } else {
+                pad_xor_block(slot->data, slot->pad, slot->len, omp_get_max_threads());
+            }
+
+            slot->writing = true;
+            slot->pending = 1;
+            uring_queue(r, slots, index, URING_WRITE_DATA, out_fd, fixed);
+            if (pad_out_fd >= 0) {
+                uring_queue(r, slots, index, URING_WRITE_PAD, pad_out_fd, fixed);
+                ++slot->pending;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (fixed)
+        syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    for (int i = 0; i < URING_DEPTH; ++i) {
+        free(slots[i].data);
+        free(slots[i].pad);
+    }
+}
+
+
+bool encrypt_uring(FILE* plain_text, FILE* output, FILE* otp) {
+    if (!is_regular(plain_text) || !is_regular(output) || !is_regular(otp))
+        return false;
+
+    uring r;
+    if (!uring_init(&r, URING_DEPTH * 2))
+        return false;
+
+    off_t cipher_size = fsize(plain_text);
+    if (cipher_size <= 0)
+        invalid_file_size("plain text");
+
+    uring_xor_files(&r, fileno(plain_text), -1, fileno(output), fileno(otp), cipher_size);
+    uring_close(&r);
+    return true;
+}
+
+
+bool decrypt_uring(FILE* cipher_text, FILE* output, FILE* otp) {
+    if (!is_regular(cipher_text) || !is_regular(output) || !is_regular(otp))
+        return false;
+
+    uring r;
+    if (!uring_init(&r, URING_DEPTH * 2))
+        return false;
+
+    off_t cipher_size = fsize(cipher_text);
+    if (cipher_size <= 0)
+        invalid_file_size("cipher text");
+
+    off_t otp_size = fsize(otp);
+    if (otp_size <= 0)
+        invalid_file_size("one-time-pad");
+
+    if (cipher_size != otp_size)
+        size_missmatch();
+
+    uring_xor_files(&r, fileno(cipher_text), fileno(otp), fileno(output), -1, cipher_size);
+    uring_close(&r);
+    return true;
+}
+
+
+bool decrypt_parallel(FILE* cipher_text, FILE* output, FILE* otp) {
+    if (!is_regular(cipher_text) || !is_regular(output) || !is_regular(otp))
+        return false;
+
+    off_t cipher_size = fsize(cipher_text);
+    if (cipher_size <= 0)
+        invalid_file_size("cipher text");
+
+    off_t otp_size = fsize(otp);
+    if (otp_size <= 0)
+        invalid_file_size("one-time-pad");
+
+    if (cipher_size != otp_size)
+        size_missmatch();
+
+    int in_fd = fileno(cipher_text), pad_fd = fileno(otp), out_fd = fileno(output);
+    if (ftruncate(out_fd, cipher_size) != 0) {
+        fprintf(stderr, "fatal: unable to resize the output file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Byte i of the output only depends on byte i of the cipher text and the
+     * pad, so every chunk is independent and the threads take them in any
+     * order. */
+    long chunks = (long) ((cipher_size + (off_t) PARALLEL_CHUNK_SIZE - 1) / (off_t) PARALLEL_CHUNK_SIZE);
+    int failed = 0;
+
+    #pragma omp parallel reduction(|:failed)
+    {
+        unsigned char *cipher_buf = aligned_alloc(PAD_ALIGNMENT, PARALLEL_CHUNK_SIZE);
+        unsigned char *pad_buf = aligned_alloc(PAD_ALIGNMENT, PARALLEL_CHUNK_SIZE);
+        if (cipher_buf == NULL || pad_buf == NULL)
+            failed = 1;
+
+        #pragma omp for schedule(dynamic)
+        for (long c = 0; c < chunks; ++c)
+        {
+            if (failed)
+                continue;
+
+            off_t offset = (off_t) c * (off_t) PARALLEL_CHUNK_SIZE;
+            size_t len = cipher_size - offset < (off_t) PARALLEL_CHUNK_SIZE
+                         ? (size_t) (cipher_size - offset) : PARALLEL_CHUNK_SIZE;
+
+            stat_timer t = stats_start();
+            if (!pread_full(in_fd, cipher_buf, len, offset)
+                || !pread_full(pad_fd, pad_buf, len, offset)) {
+                failed = 1;
+                continue;
+            }
+            stats_stop(STAT_READ, t);
+            stats_add(STAT_BYTES, len);
+
+            t = stats_start();
+            xor_buffer(cipher_buf, cipher_buf, pad_buf, len);
+            stats_stop(STAT_XOR, t);
+
+            t = stats_start();
+            if (!pwrite_full(out_fd, cipher_buf, len, offset))
+                failed = 1;
+            stats_stop(STAT_WRITE, t);
+        }
+
+        free(cipher_buf);
+        free(pad_buf);
+    }
+
+    if (failed) {
+        fprintf(stderr, "fatal: I/O error during parallel decryption\n");
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+
+bool
+pread_full(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        buf += n;
+        len -= (size_t) n;
+        offset += n;
+    }
+    return true;
+}
+
+
+bool
+pwrite_full(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+
+        buf += n;
+        len -= (size_t) n;
+        offset += n;
+    }
+    return true;
+}
+
+
+void
+sync_parent(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? concat(".", "")
+                : strndup(path, slash == path ? 1 : (size_t) (slash - path));
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0) {
+        fprintf(stderr, "fatal: unable to flush the directory \"%s\"\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(dir);
+}
+
+
+size_t
+parse_size(const char *str)
+{
+    char *end;
+    unsigned long long n = strtoull(str, &end, 10);
+    switch (*end) {
+        case 'G': n <<= 10; // fall through
+        case 'M': n <<= 10; // fall through
+        case 'K': n <<= 10; ++end; break;
+        default: break;
+    }
+
+    if (*end != '\0' || n < 1024) {
+        fprintf(stderr, "Invalid size \"%s\", expected at least 1K\n", str);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t) n;
+}
+
+
+off_t
+fsize(FILE *fp)
+{
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0)
+        return -1;
+
+    return st.st_size;
+}
+
+
+noreturn void invalid_file_size(const char *str)
+{
+    fprintf(stderr, "fatal: invalid file size \"%s\"(empty file)\n", str);
+    exit(2);
+}
+
+
+noreturn void size_missmatch(void)
+{
+    fprintf(stderr, "fatal: size mismatch during decryption\n");
+    fprintf(stderr, "       cipher text length does not equal the length of the one-time-pad\n");
+    exit(3);
+}
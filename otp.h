@@ -0,0 +1,1056 @@
+#ifndef SIMPLE_OTP_OTP_H
+#define SIMPLE_OTP_OTP_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+#include <sys/types.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#define ULL_SIZE sizeof(unsigned long long)
+#define PAD_BLOCK_SIZE ((size_t) 1 << 20)   // 1 MiB of pad per pass
+#define PAD_ALIGNMENT 64
+#define RDRAND_RETRIES 10                   // retry limit recommended by Intel
+#define RDSEED_RETRIES 1024                 // rdseed runs dry under contention far more often
+#define PAD_ENGINE_PROBE_SIZE ((size_t) 64 << 10)   // bytes each engine generates when probed
+#define HEALTH_APT_WINDOW 1024              // bytes per adaptive proportion test window
+#define HEALTH_APT_CUTOFF 26                // 1 + CRITBINOM(1024, 2^-8, 1 - 2^-40)
+#define DRBG_MAX_REQUEST ((size_t) 1 << 16)   // bytes per CTR_DRBG generate, the SP 800-90A limit
+#define DRBG_RESEED_INTERVAL 16             // generate requests between reseeds, 1 MiB of pad
+#define PIPELINE_DEPTH 4                    // blocks in flight during encryption
+#define ZERO_COPY_MIN_BLOCK ((size_t) 64 << 10) // smallest pipe --zero-copy works with
+#define DIRECT_IO_ALIGNMENT 4096            // offset, length and buffer alignment for O_DIRECT
+#define URING_DEPTH 4                       // blocks in flight per file with io_uring
+#define URING_MAX_BLOCK ((size_t) 1 << 30)  // largest buffer io_uring can register
+#define PARALLEL_CHUNK_SIZE ((size_t) 8 << 20)  // unit of work for parallel decryption
+#define BATCH_CHUNK_SIZE ((size_t) 32 << 20)    // unit of work in batch mode
+#define BATCH_CIPHER_SUFFIX ".enc"
+#define BATCH_PAD_SUFFIX ".otp"
+#define PAD_INDEX_SUFFIX ".idx"                 // index next to a packed pad store
+#define PAD_POOL_SEGMENT_SIZE ((size_t) 64 << 20)   // size of each file of a pad pool
+#define PAD_POOL_CHUNK ((size_t) 16 << 20)          // least a piped input takes from a pad pool at once
+#define PAD_POOL_DEFAULT_RESERVE ((off_t) 1 << 30)  // bytes pad-pool keeps in reserve
+#define PAD_POOL_POLL_SECONDS 1
+#define PAD_STORE_VERSION 1
+#define PAD_STORE_DATA_OFFSET 4096              // the pad material starts after the header
+#define PAD_STORE_LOG_SUFFIX ".log"             // allocation log next to a pad store
+#define PAD_ID_SIZE 16
+#define CIPHER_MAGIC "OTPCIPH1"
+#define CIPHER_VERSION 3
+#define CIPHER_HEADER_V1_SIZE 48
+#define CHUNK_ENTRY_V2_SIZE 24                  // entries before the CRCs were added
+#define CONTAINER_CHUNK_SIZE PAD_BLOCK_SIZE     // cipher text covered by one chunk entry
+#define IN_PLACE_BLOCK_SIZE ((size_t) 32 << 20)  // unit of work and of the journal in --in-place
+#define IN_PLACE_SECTOR 512                     // smallest write the storage never tears
+#define IN_PLACE_JOURNAL_SUFFIX ".journal"      // progress journal next to a file being overwritten
+#define CHECKPOINT_INTERVAL ((uint64_t) 1 << 30)   // encrypted bytes between two checkpoints
+#define CHECKPOINT_SUFFIX ".ckpt"               // encryption state next to the output
+#define MAC_KEY_SIZE 32                         // pad bytes consumed by --auth, hash key and mask
+#define MAC_TAG_SIZE 16                         // appended to the cipher text by --auth
+
+
+/**
+ * Stages timed by --stats.
+ */
+typedef enum {
+    STAT_READ, STAT_PAD, STAT_XOR, STAT_WRITE, STAT_IO_WAIT, STAT_CRC, STAT_MAC, STAT_STAGE_COUNT
+} E_STAT_STAGE;
+
+
+/**
+ * Generators pad_fill() can draw the pad from, see pad_engine_select().
+ * PAD_ENGINE_AUTO is not an engine, it asks for the fastest one that works.
+ */
+typedef enum {
+    PAD_ENGINE_RDRAND, PAD_ENGINE_RDSEED, PAD_ENGINE_GETRANDOM, PAD_ENGINE_URANDOM,
+    PAD_ENGINE_CTR_DRBG, PAD_ENGINE_COUNT, PAD_ENGINE_AUTO
+} E_PAD_ENGINE;
+
+
+/**
+ * Event counters kept by --stats.
+ */
+typedef enum {
+    STAT_BYTES, STAT_RDRAND_RETRIES, STAT_RDRAND_FAILURES, STAT_URING_ENTERS, STAT_MMAPS,
+    STAT_POOL_BYTES, STAT_DRBG_RESEEDS, STAT_ENGINE_FAILOVERS, STAT_HEALTH_WINDOWS,
+    STAT_HEALTH_FAILURES, STAT_PAD_ONES, STAT_PAD_BITS, STAT_COUNTER_COUNT
+} E_STAT_COUNTER;
+
+
+/**
+ * Wall-clock and thread CPU time at the start of a timed section.
+ */
+typedef struct {
+    struct timespec wall;
+    struct timespec cpu;
+} stat_timer;
+
+
+/**
+ * A file of a batch together with where its output and pad go.
+ */
+typedef struct {
+    char *input;
+    char *output;
+    char *pad;
+    off_t size;
+    off_t pad_offset;       // where the file's pad starts within \p pad
+    bool shared_pad;        // \p pad is a packed pad store created by the caller
+    atomic_bool failed;
+} batch_file;
+
+
+/**
+ * The header of a cipher text container, written in front of the cipher text
+ * of an encryption with a pad store. Version 1 ends after \p length and has
+ * no chunk table.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    unsigned char pad_id[PAD_ID_SIZE];
+    uint64_t pad_offset;        // within the store's pad material
+    uint64_t length;            // of the cipher text after the header
+    uint32_t chunk_size;
+    uint32_t entry_size;        // of a chunk_entry, so entries can grow
+    uint64_t chunk_count;       // entries in the chunk table after the cipher text
+} cipher_header;
+
+
+/**
+ * An entry of the chunk table that follows the cipher text of a container,
+ * one per chunk_size bytes of cipher text.
+ */
+typedef struct {
+    uint64_t offset;            // of the chunk within the cipher text
+    uint64_t pad_offset;        // of its pad within the store's pad material
+    uint32_t length;
+    uint32_t cipher_crc;        // CRC32C of the chunk's cipher text, from version 3
+    uint32_t pad_crc;           // CRC32C of the chunk's pad, from version 3
+    uint32_t reserved;
+} chunk_entry;
+
+
+/**
+ * One CHECKPOINT_INTERVAL of an encryption that a checkpoint vouches for.
+ */
+typedef struct {
+    uint64_t end;               // offset just past the interval
+    uint32_t cipher_crc;        // CRC32C of the interval's cipher text
+    uint32_t pad_crc;           // CRC32C of the interval's pad
+} checkpoint_interval;
+
+
+/**
+ * The durable state of an encryption, see encrypt_checkpointed(). The plain
+ * text's size and modification time tie the state to one input.
+ */
+typedef struct {
+    uint64_t plain_size;
+    int64_t plain_mtime_sec;
+    int64_t plain_mtime_nsec;
+    uint64_t offset;            // of the plain text encrypted so far
+    uint64_t pad_offset;        // of the pad written so far
+    size_t count;
+    checkpoint_interval *intervals;     // malloc()ed, one per interval so far
+} checkpoint;
+
+
+/**
+ * A running Wegman-Carter MAC: a polynomial hash over GF(2^128) keyed with
+ * \p h_powers[0] and masked with \p mask, both taken from the one-time-pad.
+ */
+typedef struct {
+    uint64_t acc[2];
+    uint64_t h_powers[4][2];    // H, H^2, H^3 and H^4 so four blocks share a reduction
+    uint64_t mask[2];
+    uint64_t bytes;
+    unsigned char partial[16];  // the start of a block cut by the previous update
+    size_t partial_len;
+    bool pclmul;
+} otp_mac;
+
+
+/**
+ * A pad pool opened for consumption, see pad_pool_open().
+ */
+typedef struct pad_pool pad_pool;
+
+
+/**
+ * Signature shared by every XOR kernel, see xor_buffer().
+ */
+typedef void (*xor_fn)(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t len);
+
+
+/**
+ * An XOR kernel and a check for whether the running CPU can use it,
+ * \p supported is NULL for kernels that run everywhere.
+ */
+typedef struct {
+    const char *name;
+    bool (*supported)(void);
+    xor_fn fn;
+} xor_kernel_info;
+
+
+/**
+ * Every XOR kernel, widest first.
+ */
+extern const xor_kernel_info xor_kernels[];
+extern const size_t xor_kernel_count;
+
+
+/**
+ * Returns the length of an open file \p fp.
+ * @param fp The file to take the length of.
+ * @returns The 64-bit length of file \p fp, or -1 if it could not be determined.
+ */
+off_t
+fsize(FILE *fp);
+
+
+/**
+ * A pad engine and a check for whether the running CPU can use it,
+ * \p supported is NULL for engines that run everywhere. A deterministic
+ * engine stretches a seed instead of drawing from a noise source, it is
+ * only used when asked for or once every other engine has failed.
+ */
+typedef struct {
+    const char *name;
+    bool (*supported)(void);
+    bool (*fill)(unsigned char *buf, size_t len);
+    bool deterministic;
+} pad_engine_info;
+
+
+/**
+ * Every pad engine, indexed by E_PAD_ENGINE.
+ */
+extern const pad_engine_info pad_engines[PAD_ENGINE_COUNT];
+
+
+/**
+ * Fills a buffer with random bits from the selected pad engine and runs the
+ * health tests on it, see health_test(). When the engine fails either way it
+ * is dropped for the rest of the process and the buffer is filled again
+ * from the next engine in line, see pad_engine_select().
+ * @param buf [out] The buffer to fill, should be aligned to PAD_ALIGNMENT.
+ * @param len The number of bytes to generate.
+ * @returns true on success, false once every engine has failed.
+ */
+bool
+pad_fill(unsigned char *buf, size_t len);
+
+
+/**
+ * Selects the engine behind pad_fill() for the whole process, call it before
+ * any pad is generated. The other engines the CPU supports stay behind it in
+ * table order as fallbacks, the deterministic ones last. PAD_ENGINE_AUTO
+ * probes every supported non-deterministic engine with PAD_ENGINE_PROBE_SIZE
+ * bytes and lines up those that work, fastest first, with the deterministic
+ * engines behind them as a last resort.
+ * @returns false if the running CPU lacks what \p engine needs, or no
+ * engine passed the probe.
+ */
+bool
+pad_engine_select(E_PAD_ENGINE engine);
+
+
+/**
+ * Selects PAD_ENGINE_AUTO unless an engine was already selected, pad_fill()
+ * does the same on first use.
+ * @returns The name of the engine pad_fill() draws from.
+ */
+const char *
+pad_engine_init(void);
+
+
+/**
+ * Looks up an engine by the name pad_engine_name() reports for it, or "auto".
+ * @returns PAD_ENGINE_COUNT for an unknown name.
+ */
+E_PAD_ENGINE
+pad_engine_parse(const char *name);
+
+
+/**
+ * Returns the name of the engine pad_fill() draws from, "none" before one
+ * is selected.
+ */
+const char *
+pad_engine_name(void);
+
+
+/**
+ * Fills a buffer straight from rdrand, every 64-bit step is retried up to
+ * RDRAND_RETRIES times before giving up.
+ * @returns false if the engine stayed exhausted.
+ */
+bool
+rdrand_fill(unsigned char *buf, size_t len);
+
+
+/**
+ * Fills a buffer straight from rdseed, every 64-bit step is retried up to
+ * RDSEED_RETRIES times before giving up.
+ * @returns false if the engine stayed exhausted.
+ */
+bool
+rdseed_fill(unsigned char *buf, size_t len);
+
+
+/**
+ * Runs the SP 800-90B repetition count test on the 64-bit words of \p buf,
+ * continuing from the last word the calling thread tested, and the adaptive
+ * proportion test on every whole HEALTH_APT_WINDOW bytes of it. With stats
+ * enabled it also counts the set bits for the reported bit frequency.
+ * @param buf [in] Freshly generated pad.
+ * @param len The number of bytes in \p buf.
+ * @returns NULL if \p buf passed, otherwise the name of the failed test.
+ */
+const char *
+health_test(const unsigned char *buf, size_t len);
+
+
+/**
+ * Selects the widest health test kernels (AVX-512, AVX2 or scalar) the
+ * running CPU supports. health_test() calls this itself.
+ * @returns The name of the selected kernels.
+ */
+const char *
+health_init(void);
+
+
+/**
+ * Fills a buffer from a CTR_DRBG (NIST SP 800-90A, AES-256 through AES-NI)
+ * private to the calling thread. It is seeded from rdseed, or getrandom() on
+ * CPUs without it, on first use and reseeded every DRBG_RESEED_INTERVAL
+ * requests of DRBG_MAX_REQUEST bytes.
+ * @returns false if the entropy source stayed exhausted.
+ */
+bool
+drbg_fill(unsigned char *buf, size_t len);
+
+
+/**
+ * Checks whether the running CPU has AES-NI.
+ */
+bool
+drbg_supported(void);
+
+
+/**
+ * Stores \p a XOR \p b into \p dst using the kernel picked by xor_init().
+ * \p dst may be the same buffer as \p a for an in-place XOR.
+ * @param dst [out] The buffer that receives the result.
+ * @param a   [in]  The first operand.
+ * @param b   [in]  The second operand.
+ * @param len The number of bytes in all three buffers.
+ */
+void
+xor_buffer(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t len);
+
+
+/**
+ * Selects the widest XOR kernel (AVX-512, AVX2 or SSE2) the running CPU supports.
+ * @returns The name of the selected kernel.
+ */
+const char *
+xor_init(void);
+
+
+/**
+ * Selects the CRC32C implementation, the SSE4.2 crc32 instruction where the
+ * CPU has it and a slicing-by-8 table otherwise. crc32c() calls this itself.
+ * @returns The name of the selected implementation.
+ */
+const char *
+crc32c_init(void);
+
+
+/**
+ * Continues the CRC32C (Castagnoli) \p crc over \p len bytes of \p buf.
+ * @param crc 0 to start a new checksum, or the result of the previous call.
+ * @returns The updated checksum.
+ */
+uint32_t
+crc32c(uint32_t crc, const unsigned char *buf, size_t len);
+
+
+/**
+ * Starts a MAC with a one-time \p key that must never be used for a second
+ * message. Uses pclmul where the CPU has it and a bitwise multiply otherwise.
+ * @param m   [out] The MAC to initialise.
+ * @param key [in]  MAC_KEY_SIZE bytes of pad, the hash key followed by the mask.
+ */
+void
+mac_init(otp_mac *m, const unsigned char key[MAC_KEY_SIZE]);
+
+
+/**
+ * Feeds the next \p len bytes of the message into \p m, in pieces of any size.
+ */
+void
+mac_update(otp_mac *m, const unsigned char *buf, size_t len);
+
+
+/**
+ * Finishes \p m and wipes it.
+ * @param tag [out] Receives MAC_TAG_SIZE bytes.
+ */
+void
+mac_final(otp_mac *m, unsigned char tag[MAC_TAG_SIZE]);
+
+
+/**
+ * Finishes \p m and compares the result with \p tag in constant time.
+ * @returns true if \p tag is the tag of the message fed into \p m.
+ */
+bool
+mac_verify(otp_mac *m, const unsigned char tag[MAC_TAG_SIZE]);
+
+
+/**
+ * Fills \p pad with \p len bytes from pad_fill() and XORs it into \p data,
+ * with each OpenMP thread owning one PAD_BLOCK_SIZE chunk so chunk c always
+ * maps to offset c * PAD_BLOCK_SIZE. Exits with code 3 if every pad engine
+ * fails.
+ * @param data [in,out] The plain text, XORed in place into the cipher text.
+ * @param pad  [out]    Receives the generated one-time-pad.
+ * @param len The number of bytes in both buffers.
+ * @param threads The size of the OpenMP team, threads other than main do not
+ *                inherit the count set with --threads.
+ */
+void
+pad_xor_block(unsigned char *data, unsigned char *pad, size_t len, int threads);
+
+
+/**
+ * Encrypts in input file, using random numbers generated from a secure source
+ * and outputs the random bits and encrypted message. The plain text is read
+ * until EOF, so it may be a pipe.
+ * @param plain_text [in]  An open connection to the plain-text file in binary read mode.
+ * @param output     [out] An open connection to the output file in binary write mode.
+ * @param otp        [out] An open connection to a file that will contain the one-time-pad for \p output.
+ */
+void
+encrypt(FILE* plain_text, FILE* output, FILE* otp);
+
+
+/**
+ * Encrypts like encrypt(), but takes the pad from a pad pool filled ahead of
+ * time by pad_pool_serve(). Once the pool runs dry the rest of the pad is
+ * generated inline as usual.
+ * @param plain_text [in]  An open connection to the plain-text file in binary read mode.
+ * @param output     [out] An open connection to the output file in binary write mode.
+ * @param otp        [out] An open connection to a file that will contain the one-time-pad for \p output.
+ * @param pool       [in]  The pad pool to consume from.
+ */
+void
+encrypt_pool(FILE* plain_text, FILE* output, FILE* otp, pad_pool *pool);
+
+
+/**
+ * Encrypts like encrypt(), or encrypt_pool() when \p pool is non-NULL, and
+ * makes progress durable every CHECKPOINT_INTERVAL bytes: the cipher text and
+ * pad are flushed and \p state_path is replaced with a checkpoint holding the
+ * offsets and the CRC32C of every interval. The checkpoint is removed when the
+ * encryption completes. Without regular files no checkpoints are taken.
+ * @param plain_text [in]  An open connection to the plain-text file in binary read mode.
+ * @param output     [out] An open connection to the output file, read/write when resuming.
+ * @param otp        [out] An open connection to the one-time-pad, read/write when resuming.
+ * @param pool       [in]  The pad pool to consume from, or NULL.
+ * @param state_path Where the checkpoint lives.
+ * @param resume Continue after the checkpoint at \p state_path: the output
+ *               and pad are cut back to it and its last interval is checked
+ *               against its CRCs, exiting with code 3 on a mismatch.
+ */
+void
+encrypt_checkpointed(FILE* plain_text, FILE* output, FILE* otp, pad_pool *pool,
+                     const char *state_path, bool resume);
+
+
+/**
+ * Reads the checkpoint at \p path, exiting if it is corrupt.
+ * @returns false if there is none.
+ */
+bool
+checkpoint_read(const char *path, checkpoint *c);
+
+
+/**
+ * Replaces the checkpoint at \p path with \p c through a temporary file, so
+ * a crash leaves either the old or the new checkpoint.
+ */
+void
+checkpoint_write(const char *path, const checkpoint *c);
+
+
+/**
+ * Encrypts like encrypt() and authenticates the cipher text, so a changed bit
+ * is caught by decrypt_auth(). MAC_KEY_SIZE more bytes of pad are generated
+ * as the one-time MAC key and appended to the one-time-pad, and the tag over
+ * the cipher text, computed as each block is XORed, is appended to \p output.
+ * @param plain_text [in]  An open connection to the plain-text file in binary read mode.
+ * @param output     [out] An open connection to the output file in binary write mode.
+ * @param otp        [out] An open connection to a file that will contain the one-time-pad for \p output.
+ * @param pool       [in]  The pad pool to consume from like encrypt_pool(), or NULL.
+ */
+void
+encrypt_auth(FILE* plain_text, FILE* output, FILE* otp, pad_pool *pool);
+
+
+/**
+ * Decrypts in input file using a one-time-pad and directing the output to a specified output.
+ * The cipher text may be a pipe, the one-time-pad has to be a regular file.
+ * @param cipher_text [in]  An open connection to the cipher-text file in binary read mode.
+ * @param output      [out] An open connection to the output file in binary write mode.
+ * @param otp         [in]  An open connection to the one-time-pad in binary read mode.
+ */
+void
+decrypt(FILE* cipher_text, FILE* output, FILE* otp);
+
+
+/**
+ * Decrypts a cipher text written by encrypt_auth(), checking its tag once the
+ * last byte has been XORed. On a mismatch a regular output file is truncated
+ * so no unauthenticated plain text is left behind, and the program exits with
+ * code 3; a piped output has already been passed on by then.
+ * The cipher text may be a pipe, the one-time-pad has to be a regular file.
+ * @param cipher_text [in]  An open connection to the cipher-text file in binary read mode.
+ * @param output      [out] An open connection to the output file in binary write mode.
+ * @param otp         [in]  An open connection to the one-time-pad in binary read mode.
+ */
+void
+decrypt_auth(FILE* cipher_text, FILE* output, FILE* otp);
+
+
+/**
+ * Checks whether a regular cipher text and its one-time-pad have the lengths
+ * encrypt_auth() writes, the pad MAC_KEY_SIZE - MAC_TAG_SIZE bytes longer.
+ */
+bool
+is_authenticated(FILE* cipher_text, FILE* otp);
+
+
+/**
+ * Decrypts like decrypt(), but maps the cipher text, one-time-pad and output
+ * into memory and XORs straight across the mappings instead of using stdio.
+ * @param cipher_text [in]  An open connection to the cipher-text file in binary read mode.
+ * @param output      [out] An open connection to the output file in binary read/write mode.
+ * @param otp         [in]  An open connection to the one-time-pad in binary read mode.
+ */
+void
+decrypt_mmap(FILE* cipher_text, FILE* output, FILE* otp);
+
+
+/**
+ * Encrypts like encrypt(), but drives the reads and writes through io_uring
+ * with URING_DEPTH blocks in flight per file.
+ * @param plain_text [in]  An open connection to the plain-text file in binary read mode.
+ * @param output     [out] An open connection to the output file in binary write mode.
+ * @param otp        [out] An open connection to a file that will contain the one-time-pad for \p output.
+ * @returns false without touching any file if io_uring is unavailable or one
+ *          of the files is not a regular file.
+ */
+bool
+encrypt_uring(FILE* plain_text, FILE* output, FILE* otp);
+
+
+/**
+ * Decrypts like decrypt(), but drives the reads and writes through io_uring
+ * with URING_DEPTH blocks in flight per file.
+ * @param cipher_text [in]  An open connection to the cipher-text file in binary read mode.
+ * @param output      [out] An open connection to the output file in binary write mode.
+ * @param otp         [in]  An open connection to the one-time-pad in binary read mode.
+ * @returns false without touching any file if io_uring is unavailable or one
+ *          of the files is not a regular file.
+ */
+bool
+decrypt_uring(FILE* cipher_text, FILE* output, FILE* otp);
+
+
+/**
+ * Decrypts like decrypt(), but splits the file into PARALLEL_CHUNK_SIZE chunks
+ * that the OpenMP threads process independently with pread()/pwrite().
+ * @param cipher_text [in]  An open connection to the cipher-text file in binary read mode.
+ * @param output      [out] An open connection to the output file in binary write mode.
+ * @param otp         [in]  An open connection to the one-time-pad in binary read mode.
+ * @returns false without touching any file if one of the files is not a regular file.
+ */
+bool
+decrypt_parallel(FILE* cipher_text, FILE* output, FILE* otp);
+
+
+/**
+ * Encrypts or decrypts the regular file \p path by overwriting it, so no
+ * second copy of the file is needed. Progress is kept in a journal at
+ * path + IN_PLACE_JOURNAL_SUFFIX: the pad and the CRC32C of every
+ * IN_PLACE_SECTOR of a block are durable before the block is overwritten,
+ * so a run that finds a journal finishes the interrupted block and resumes
+ * after it. The journal is removed once the whole file is done.
+ * @param path The file to overwrite.
+ * @param otp_path The one-time-pad, created when encrypting.
+ * @param encrypting true to encrypt, false to decrypt.
+ * @param verbose Receives a line when an interrupted run is resumed.
+ */
+void
+xor_in_place(const char *path, const char *otp_path, bool encrypting, FILE *verbose);
+
+
+/**
+ * Reads exactly \p len bytes at \p offset, retrying short and interrupted reads.
+ * @returns false on an I/O error or if the file ends early.
+ */
+bool
+pread_full(int fd, unsigned char *buf, size_t len, off_t offset);
+
+
+/**
+ * Writes exactly \p len bytes at \p offset, retrying short and interrupted writes.
+ * @returns false on an I/O error.
+ */
+bool
+pwrite_full(int fd, const unsigned char *buf, size_t len, off_t offset);
+
+
+/**
+ * Makes the directory entry of a file just created or renamed at \p path
+ * durable, exits on failure.
+ */
+void
+sync_parent(const char *path);
+
+
+/**
+ * A regular output file written by the encryption pipeline, tuned for
+ * --direct and --drop-cache. Other outputs are written through stdio.
+ */
+typedef struct {
+    FILE *fp;
+    int fd;                     // -1 to write through stdio
+    off_t offset;               // where the next write goes
+    off_t dropped;              // everything before it has left the page cache
+    int flags;                  // the file status flags without O_DIRECT
+    bool direct_ok;             // O_DIRECT was asked for and the file system takes it
+    bool direct;                // O_DIRECT is set right now
+} output_writer;
+
+
+/**
+ * Asks for --direct, the encryption pipeline then writes its outputs with
+ * O_DIRECT, see output_write().
+ */
+void
+direct_io_request(void);
+
+
+/**
+ * Asks for --drop-cache, the encryption pipeline then evicts what it has read
+ * and written from the page cache as it goes.
+ */
+void
+drop_cache_request(void);
+
+
+/**
+ * Returns the alignment for buffers passed to output_write(),
+ * DIRECT_IO_ALIGNMENT with --direct and PAD_ALIGNMENT otherwise.
+ */
+size_t
+output_buffer_alignment(void);
+
+
+/**
+ * Starts writing \p fp at its current position. For a regular file the next
+ * \p size bytes are allocated up front without changing its size.
+ * @param w [out] The writer to set up.
+ * @param fp The output, flushed before anything is written past stdio.
+ * @param size The number of bytes expected, 0 if unknown.
+ */
+void
+output_open(output_writer *w, FILE *fp, off_t size);
+
+
+/**
+ * Appends \p len bytes to the output of \p w. With --direct the whole
+ * DIRECT_IO_ALIGNMENT blocks bypass the page cache and only an unaligned tail
+ * goes through it, with --drop-cache the output is evicted from the cache one
+ * write behind.
+ * @returns false on an I/O error.
+ */
+bool
+output_write(output_writer *w, const unsigned char *buf, size_t len);
+
+
+/**
+ * Finishes the output of \p w and leaves its stream positioned after the
+ * last write.
+ * @returns false if the stream could not be repositioned.
+ */
+bool
+output_close(output_writer *w);
+
+
+/**
+ * Tells the kernel \p fp is read once from start to end.
+ */
+void
+input_advise(FILE *fp);
+
+
+/**
+ * With --drop-cache, evicts \p len bytes of \p fp that were read at \p offset
+ * from the page cache.
+ */
+void
+input_drop(FILE *fp, off_t offset, size_t len);
+
+
+/**
+ * Asks for --zero-copy output, see zero_copy_open().
+ */
+void
+zero_copy_request(void);
+
+
+/**
+ * Prepares \p fp for vmsplice() when --zero-copy was asked for and it is a
+ * pipe. Pages handed to a pipe stay referenced until the reader consumes
+ * them, so the pipe is resized to hold no more than \p block bytes: once a
+ * whole block has been spliced after another, the earlier one has been
+ * read and its buffer may be reused. A reader that splices the pages on
+ * instead of reading them can still see a reused buffer, so this is opt-in.
+ * @param fp The output stream, flushed before the first splice.
+ * @param block The size of every block but the last, at least ZERO_COPY_MIN_BLOCK.
+ * @returns The descriptor to splice to, or -1 to write \p fp through stdio.
+ */
+int
+zero_copy_open(FILE *fp, size_t block);
+
+
+/**
+ * Hands \p len bytes to the pipe \p fd without copying, retrying short and
+ * interrupted calls. The pages must not change until the reader has them,
+ * see zero_copy_open().
+ * @returns false on an I/O error.
+ */
+bool
+vmsplice_full(int fd, const unsigned char *buf, size_t len);
+
+
+/**
+ * Maps \p len bytes of fresh anonymous pages, for buffers given to
+ * vmsplice_full(). Unlike the heap they are never handed out again while a
+ * pipe may still reference them.
+ * @returns NULL on failure.
+ */
+unsigned char *
+page_alloc(size_t len);
+
+
+/**
+ * Unmaps a buffer from page_alloc(), NULL is ignored.
+ */
+void
+page_free(unsigned char *p, size_t len);
+
+
+/**
+ * Encrypts or decrypts every file in \p files on a work-stealing pool of
+ * omp_get_max_threads() workers. Files are split into BATCH_CHUNK_SIZE chunks
+ * so small and huge files balance across the workers. Encrypting "x" writes
+ * "x.enc" and the pad "x.otp"; decrypting "x.enc" reads the pad "x.otp" and
+ * writes "x" (other names get ".dec" appended).
+ * @param encrypting true to encrypt, false to decrypt.
+ * @param files The paths to process.
+ * @param count The number of entries in \p files.
+ * @returns The number of files that could not be processed, each of which
+ *          has been reported on stderr.
+ */
+size_t
+batch_run(bool encrypting, char *const files[], size_t count);
+
+
+/**
+ * Runs a batch whose names have already been filled in, see batch_run().
+ * @param encrypting true to encrypt, false to decrypt.
+ * @param keep_empty true to process empty files instead of reporting them.
+ * @param files The files to process, \p size is filled in on the way.
+ * @param count The number of entries in \p files.
+ * @returns The number of files that could not be processed.
+ */
+size_t
+batch_execute(bool encrypting, bool keep_empty, batch_file *files, size_t count);
+
+
+/**
+ * Returns a malloc()ed copy of \p str with \p suffix appended, exits when out of memory.
+ */
+char *
+concat(const char *str, const char *suffix);
+
+
+/**
+ * Returns a malloc()ed copy of \p name without a trailing BATCH_CIPHER_SUFFIX.
+ */
+char *
+strip_cipher_suffix(const char *name);
+
+
+/**
+ * Encrypts every regular file below \p dir into a mirrored tree, walking the
+ * directories in parallel and encrypting through batch_execute().
+ * @param dir The directory to encrypt.
+ * @param out_dir Receives the mirrored tree of cipher texts.
+ * @param pad_path A directory that receives a mirrored tree of pads, or with
+ *                 \p pack_pads a single pad store with an index at
+ *                 pad_path + PAD_INDEX_SUFFIX listing each file's pad offset
+ *                 and size, and every directory with "-" for both.
+ * @param pack_pads Whether to pack every pad into one store.
+ * @returns The number of files that could not be encrypted.
+ */
+size_t
+dir_encrypt(const char *dir, const char *out_dir, const char *pad_path, bool pack_pads);
+
+
+/**
+ * Decrypts a tree written by dir_encrypt(). A regular file \p pad_path is
+ * read as a packed pad store through its index, a directory as a pad tree.
+ * @returns The number of files that could not be decrypted.
+ */
+size_t
+dir_decrypt(const char *dir, const char *out_dir, const char *pad_path);
+
+
+/**
+ * Opens the pad pool in \p dir for consumption, creating an empty one if needed.
+ */
+pad_pool *
+pad_pool_open(const char *dir);
+
+
+/**
+ * Copies up to \p len bytes of pad material out of \p pool. Every byte is
+ * handed out at most once, also across processes and crashes: the pool's
+ * ledger moves past a range before the range is read.
+ * @param pool The pool to consume from.
+ * @param buf [out] Receives the pad material.
+ * @param len The number of bytes wanted.
+ * @param hint How many bytes the caller expects to take in total, so a
+ *             known-size input is reserved in one step and exactly. 0 for an
+ *             input of unknown length, which reserves at least PAD_POOL_CHUNK
+ *             bytes at a time. Bytes reserved but never taken are lost, not
+ *             returned to the pool.
+ * @returns The number of bytes copied, less than \p len once the pool is empty.
+ */
+size_t
+pad_pool_take(pad_pool *pool, unsigned char *buf, size_t len, size_t hint);
+
+
+/**
+ * Closes \p pool, dropping whatever it still had reserved.
+ */
+void
+pad_pool_close(pad_pool *pool);
+
+
+/**
+ * Keeps the pad pool in \p dir filled with at least \p reserve bytes from
+ * pad_fill(), in PAD_POOL_SEGMENT_SIZE files. Runs with idle priority and checks
+ * the level every PAD_POOL_POLL_SECONDS.
+ * @param dir The pool directory, created if needed.
+ * @param reserve The number of bytes to keep available.
+ * @param once Return once the reserve is full instead of running forever.
+ * @param verbose Receives a line per generated segment.
+ */
+void
+pad_pool_serve(const char *dir, off_t reserve, bool once, FILE *verbose);
+
+
+/**
+ * Creates a pad store: a header with a random identifier followed by \p size
+ * bytes from pad_fill(), and an empty allocation log at
+ * path + PAD_STORE_LOG_SUFFIX. An existing store is never overwritten.
+ * @param path The store to create.
+ * @param size The number of bytes of pad material.
+ */
+void
+pad_store_create(const char *path, off_t size);
+
+
+/**
+ * Encrypts with the next unused range of a pad store instead of a new pad.
+ * The range is recorded in the store's allocation log before it is used and
+ * in a container around the cipher text, see container_encrypt().
+ * The output is only created once the range is taken, so a store without
+ * enough pad left leaves no empty cipher text behind.
+ * @param plain_text  [in] An open connection to the plain-text file, has to be a regular file.
+ * @param output_name The file to write the container to, "-" for stdout.
+ * @param store_path  The pad store, see pad_store_create().
+ */
+void
+encrypt_store(FILE *plain_text, const char *output_name, const char *store_path);
+
+
+/**
+ * Checks whether \p otp is a pad store rather than a plain one-time-pad.
+ */
+bool
+is_pad_store(FILE *otp);
+
+
+/**
+ * Decrypts a cipher text written by encrypt_store() with the range of the
+ * pad store its header names. The cipher text may be a pipe.
+ * @param cipher_text [in]  An open connection to the cipher-text file in binary read mode.
+ * @param output      [out] An open connection to the output file in binary write mode.
+ * @param otp         [in]  An open connection to the pad store.
+ */
+void
+decrypt_store(FILE *cipher_text, FILE *output, FILE *otp);
+
+
+/**
+ * Decrypts only \p len bytes at \p offset of a container written by
+ * encrypt_store(), reading just the chunk table entries, cipher text and pad
+ * material that cover them. Chunks cut by the range are read whole so their
+ * CRC32C can be checked.
+ * @param cipher_text [in]  An open connection to the cipher-text file, has to be a regular file.
+ * @param output      [out] An open connection to the output file in binary write mode.
+ * @param otp         [in]  An open connection to the pad store.
+ * @param offset The first byte of plain text to recover.
+ * @param len The number of bytes to recover, ending at most at the end of the plain text.
+ */
+void
+decrypt_store_range(FILE *cipher_text, FILE *output, FILE *otp, uint64_t offset, uint64_t len);
+
+
+/**
+ * Writes a container: a cipher_header, the plain text XORed with the pad
+ * range, and the chunk table with the CRC32C of every cipher text and pad chunk.
+ * @param plain_text [in]  The plain text, exactly \p length bytes are read.
+ * @param output     [out] Receives the container, may be a pipe.
+ * @param pad_fd  The pad store.
+ * @param pad_id  The identifier of the store.
+ * @param pad_offset The start of the range within the store's pad material.
+ * @param length  The length of the plain text and of the range.
+ */
+void
+container_encrypt(FILE *plain_text, FILE *output, int pad_fd,
+                  const unsigned char pad_id[PAD_ID_SIZE], uint64_t pad_offset, uint64_t length);
+
+
+/**
+ * Decrypts a whole container front to back. The CRC32C of every cipher text
+ * and pad chunk is checked before the chunk is written when \p cipher_text
+ * is a regular file, and once the chunk table has been reached for a pipe.
+ * @param pad_size The number of bytes of pad material in the store.
+ */
+void
+container_decrypt(FILE *cipher_text, FILE *output, int pad_fd,
+                  const unsigned char pad_id[PAD_ID_SIZE], uint64_t pad_size);
+
+
+/**
+ * Decrypts \p len bytes at \p offset of a container, see decrypt_store_range().
+ */
+void
+container_decrypt_range(FILE *cipher_text, FILE *output, int pad_fd,
+                        const unsigned char pad_id[PAD_ID_SIZE], uint64_t pad_size,
+                        uint64_t offset, uint64_t len);
+
+
+/**
+ * Parses a byte count with an optional K, M or G suffix, exiting on anything
+ * else or on less than 1K.
+ */
+size_t
+parse_size(const char *str);
+
+
+/**
+ * Appends the paths listed in a manifest, one per line, to \p files.
+ * @param name The manifest to read, "-" for stdin.
+ * @param files A malloc()ed array of paths, or NULL.
+ * @param count [in,out] The number of entries in \p files.
+ * @returns The grown array.
+ */
+char **
+batch_read_manifest(const char *name, char **files, size_t *count);
+
+
+/**
+ * Exit routine when an invalid file is specified.
+ * @param str A string indicating which file was invalid.
+ */
+noreturn void
+invalid_file_size(const char *str);
+
+
+/**
+ * Exit routine for when there is a size mismatch between the cipher text and
+ *  the one-time-pad.
+ */
+noreturn void
+size_missmatch(void);
+
+
+/**
+ * Turns on statistics collection and registers an atexit() handler that
+ * prints them as JSON to stderr, also when the run is aborted.
+ * @param mode The program mode reported in the JSON ("encrypt" or "decrypt").
+ */
+void
+stats_enable(const char *mode);
+
+
+/**
+ * Marks the run as having finished successfully.
+ */
+void
+stats_complete(void);
+
+
+/**
+ * Starts timing a section, a no-op unless stats are enabled.
+ * @returns The timer to pass to stats_stop().
+ */
+stat_timer
+stats_start(void);
+
+
+/**
+ * Adds the wall-clock and thread CPU time since \p t to \p stage.
+ */
+void
+stats_stop(E_STAT_STAGE stage, stat_timer t);
+
+
+/**
+ * Checks whether stats are enabled, for work that is only done to be reported.
+ */
+bool
+stats_active(void);
+
+
+/**
+ * Adds \p n to \p counter, a no-op unless stats are enabled.
+ */
+void
+stats_add(E_STAT_COUNTER counter, unsigned long long n);
+
+
+/**
+ * Writes the collected statistics as a single line of JSON.
+ * @param fp The stream to write to.
+ */
+void
+stats_print_json(FILE *fp);
+
+#endif // SIMPLE_OTP_OTP_H
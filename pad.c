@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>  // Intel random generation engine
+
+#include "otp.h"
+
+
+/**
+ * Retries a single rdrand64 step up to RDRAND_RETRIES times.
+ */
+__attribute__((target("rdrnd"))) static bool
+rdrand64_retry(unsigned long long *val)
+{
+    for (int i = 0; i < RDRAND_RETRIES; ++i) {
+        if (_rdrand64_step(val))
+            return true;
+        stats_add(STAT_RDRAND_RETRIES, 1);
+    }
+
+    stats_add(STAT_RDRAND_FAILURES, 1);
+    return false;
+}
+
+
+__attribute__((target("rdrnd"))) bool
+rdrand_fill(unsigned char *buf, size_t len)
+{
+    unsigned long long *words = (unsigned long long *) buf;
+    size_t n_words = len / ULL_SIZE;
+    size_t i = 0;
+
+    /* Unrolled by four, the retry path is only taken when one of the four
+     * steps reports that the engine ran dry. */
+    for (; i + 4 <= n_words; i += 4)
+    {
+        int ok = _rdrand64_step(&words[i])
+               & _rdrand64_step(&words[i + 1])
+               & _rdrand64_step(&words[i + 2])
+               & _rdrand64_step(&words[i + 3]);
+        if (!ok)
+        {
+            stats_add(STAT_RDRAND_RETRIES, 1);
+            for (size_t j = i; j < i + 4; ++j)
+                if (!rdrand64_retry(&words[j]))
+                    return false;
+        }
+    }
+
+    for (; i < n_words; ++i)
+        if (!rdrand64_retry(&words[i]))
+            return false;
+
+    // fill the trailing bytes that do not make up a whole word
+    size_t remain = len % ULL_SIZE;
+    if (remain)
+    {
+        unsigned long long tail;
+        if (!rdrand64_retry(&tail))
+            return false;
+        memcpy(buf + n_words * ULL_SIZE, &tail, remain);
+    }
+
+    return true;
+}
+
+
+__attribute__((target("rdseed"))) bool
+rdseed_fill(unsigned char *buf, size_t len)
+{
+    for (size_t done = 0; done < len; done += ULL_SIZE)
+    {
+        unsigned long long word;
+        int tries = 0;
+        // spin while the engine has no seed ready
+        while (!_rdseed64_step(&word))
+        {
+            if (++tries == RDSEED_RETRIES)
+            {
+                stats_add(STAT_RDRAND_FAILURES, 1);
+                return false;
+            }
+            _mm_pause();
+        }
+        memcpy(buf + done, &word, len - done < ULL_SIZE ? len - done : ULL_SIZE);
+    }
+
+    return true;
+}
+
+
+void
+pad_xor_block(unsigned char *data, unsigned char *pad, size_t len, int threads)
+{
+    long chunks = (long) ((len + PAD_BLOCK_SIZE - 1) / PAD_BLOCK_SIZE);
+    int failed = 0;
+
+    #pragma omp parallel for schedule(static) reduction(|:failed) num_threads(threads)
+    for (long c = 0; c < chunks; ++c)
+    {
+        size_t offset = (size_t) c * PAD_BLOCK_SIZE;
+        size_t chunk = len - offset < PAD_BLOCK_SIZE ? len - offset : PAD_BLOCK_SIZE;
+
+        stat_timer t = stats_start();
+        if (!pad_fill(pad + offset, chunk)) {
+            failed = 1;
+            continue;
+        }
+        stats_stop(STAT_PAD, t);
+
+        t = stats_start();
+        xor_buffer(data + offset, data + offset, pad + offset, chunk);
+        stats_stop(STAT_XOR, t);
+    }
+
+    if (failed)
+    {
+        fprintf(stderr, "failed to read from sysrand\n");
+        exit(3);
+    }
+}
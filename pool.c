@@ -0,0 +1,322 @@
+#define _GNU_SOURCE    // SCHED_IDLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+
+#define PAD_POOL_LEDGER "ledger"
+#define PAD_POOL_MAGIC "OTPPOOL1"
+
+
+/**
+ * The on-disk ledger of a pool. Segments head..next-1 exist, the first
+ * head_offset bytes of segment head have already been handed out.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t head;
+    uint64_t head_offset;
+    uint64_t next;
+} pad_pool_ledger;
+
+
+/**
+ * A range of a segment reserved by this process, read through \p fd so the
+ * segment may already be unlinked.
+ */
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t len;
+} pad_pool_range;
+
+
+struct pad_pool {
+    char *dir;
+    int ledger_fd;
+    pad_pool_range *ranges;
+    size_t n_ranges, current;
+};
+
+
+static char *
+segment_name(const char *dir, uint64_t seq)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%012llu.pad", (unsigned long long) seq);
+    return concat(dir, name);
+}
+
+
+/**
+ * Opens (creating if needed) the ledger of the pool in \p dir.
+ */
+static int
+ledger_open(const char *dir)
+{
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create the pad pool \"%s\"\n", dir);
+        exit(EXIT_FAILURE);
+    }
+
+    char *name = concat(dir, "/" PAD_POOL_LEDGER);
+    int fd = open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open the pad pool ledger \"%s\"\n", name);
+        exit(EXIT_FAILURE);
+    }
+    free(name);
+    return fd;
+}
+
+
+/**
+ * Takes the ledger lock and reads the ledger, a new pool starts out empty.
+ */
+static pad_pool_ledger
+ledger_lock(int fd)
+{
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "fatal: unable to lock the pad pool ledger\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pad_pool_ledger l;
+    if (!pread_full(fd, (unsigned char *) &l, sizeof(l), 0)) {
+        memset(&l, 0, sizeof(l));
+        memcpy(l.magic, PAD_POOL_MAGIC, sizeof(l.magic));
+    } else if (memcmp(l.magic, PAD_POOL_MAGIC, sizeof(l.magic)) != 0) {
+        fprintf(stderr, "fatal: the pad pool ledger is corrupt\n");
+        exit(EXIT_FAILURE);
+    }
+    return l;
+}
+
+
+/**
+ * Makes \p l durable, the ledger fits in one sector so the write is atomic.
+ */
+static void
+ledger_write(int fd, const pad_pool_ledger *l)
+{
+    if (!pwrite_full(fd, (const unsigned char *) l, sizeof(*l), 0) || fdatasync(fd) != 0) {
+        fprintf(stderr, "fatal: unable to update the pad pool ledger\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void
+ledger_unlock(int fd)
+{
+    flock(fd, LOCK_UN);
+}
+
+
+pad_pool *
+pad_pool_open(const char *dir)
+{
+    pad_pool *pool = calloc(1, sizeof(pad_pool));
+    if (pool == NULL) {
+        fprintf(stderr, "fatal: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pool->dir = concat(dir, "");
+    pool->ledger_fd = ledger_open(dir);
+    return pool;
+}
+
+
+/**
+ * Moves the ledger past up to \p len bytes and keeps the segments open for
+ * this process. The ledger is durable before any byte is used, so a crash
+ * can lose pad material but never hand it out twice.
+ */
+static void
+pad_pool_reserve(pad_pool *pool, size_t len)
+{
+    pool->n_ranges = pool->current = 0;
+
+    pad_pool_ledger l = ledger_lock(pool->ledger_fd);
+    uint64_t first = l.head;
+
+    while (len > 0 && l.head < l.next) {
+        char *name = segment_name(pool->dir, l.head);
+        int fd = open(name, O_RDONLY);
+        free(name);
+
+        // a segment lost in a crash is skipped, never generated again
+        if (fd < 0) {
+            ++l.head;
+            l.head_offset = 0;
+            continue;
+        }
+
+        size_t take = PAD_POOL_SEGMENT_SIZE - l.head_offset < len
+                      ? PAD_POOL_SEGMENT_SIZE - l.head_offset : len;
+        pool->ranges = realloc(pool->ranges, (pool->n_ranges + 1) * sizeof(pad_pool_range));
+        if (pool->ranges == NULL) {
+            fprintf(stderr, "fatal: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        pool->ranges[pool->n_ranges++] = (pad_pool_range) {
+            .fd = fd, .offset = (off_t) l.head_offset, .len = take,
+        };
+
+        len -= take;
+        l.head_offset += take;
+        if (l.head_offset == PAD_POOL_SEGMENT_SIZE) {
+            ++l.head;
+            l.head_offset = 0;
+        }
+    }
+
+    if (pool->n_ranges > 0 || l.head != first)
+        ledger_write(pool->ledger_fd, &l);
+
+    // exhausted segments stay readable through the descriptors opened above
+    for (uint64_t seq = first; seq < l.head; ++seq) {
+        char *name = segment_name(pool->dir, seq);
+        unlink(name);
+        free(name);
+    }
+    ledger_unlock(pool->ledger_fd);
+}
+
+
+size_t
+pad_pool_take(pad_pool *pool, unsigned char *buf, size_t len, size_t hint)
+{
+    size_t done = 0;
+    while (done < len) {
+        if (pool->current == pool->n_ranges) {
+            // only a piped input of unknown length reserves ahead in whole chunks
+            size_t want = len - done > hint ? len - done : hint;
+            if (hint == 0 && want < PAD_POOL_CHUNK)
+                want = PAD_POOL_CHUNK;
+            pad_pool_reserve(pool, want);
+            if (pool->n_ranges == 0)
+                break;
+        }
+
+        pad_pool_range *r = &pool->ranges[pool->current];
+        size_t n = r->len < len - done ? r->len : len - done;
+        if (!pread_full(r->fd, buf + done, n, r->offset)) {
+            fprintf(stderr, "fatal: unable to read from the pad pool\n");
+            exit(EXIT_FAILURE);
+        }
+        r->offset += (off_t) n;
+        r->len -= n;
+        done += n;
+
+        if (r->len == 0)
+            close(pool->ranges[pool->current++].fd);
+    }
+    return done;
+}
+
+
+void
+pad_pool_close(pad_pool *pool)
+{
+    // reserved bytes that were not used are dropped with their descriptors
+    for (size_t i = pool->current; i < pool->n_ranges; ++i)
+        close(pool->ranges[i].fd);
+    close(pool->ledger_fd);
+    free(pool->ranges);
+    free(pool->dir);
+    free(pool);
+}
+
+
+/**
+ * Generates one segment into a temporary file and publishes it under the
+ * next sequence number once it is durable.
+ */
+static void
+pad_pool_add_segment(const char *dir, int ledger_fd, unsigned char *buf)
+{
+    long chunks = (long) (PAD_POOL_SEGMENT_SIZE / PAD_BLOCK_SIZE);
+    int failed = 0;
+
+    #pragma omp parallel for schedule(static) reduction(|:failed)
+    for (long c = 0; c < chunks; ++c)
+        if (!pad_fill(buf + (size_t) c * PAD_BLOCK_SIZE, PAD_BLOCK_SIZE))
+            failed = 1;
+
+    if (failed) {
+        fprintf(stderr, "failed to read from sysrand\n");
+        exit(3);
+    }
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "/tmp.%ld", (long) getpid());
+    char *tmp = concat(dir, suffix);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || !pwrite_full(fd, buf, PAD_POOL_SEGMENT_SIZE, 0) || fsync(fd) != 0) {
+        fprintf(stderr, "fatal: unable to write a pad pool segment\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    pad_pool_ledger l = ledger_lock(ledger_fd);
+    char *name = segment_name(dir, l.next);
+    if (rename(tmp, name) != 0) {
+        fprintf(stderr, "fatal: unable to publish a pad pool segment\n");
+        exit(EXIT_FAILURE);
+    }
+    ++l.next;
+    ledger_write(ledger_fd, &l);
+    ledger_unlock(ledger_fd);
+
+    free(name);
+    free(tmp);
+}
+
+
+void
+pad_pool_serve(const char *dir, off_t reserve, bool once, FILE *verbose)
+{
+    // only take cycles nothing else wants
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, SCHED_IDLE, &param) != 0)
+        setpriority(PRIO_PROCESS, 0, 19);
+
+    int ledger_fd = ledger_open(dir);
+    unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, PAD_POOL_SEGMENT_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        pad_pool_ledger l = ledger_lock(ledger_fd);
+        off_t available = (off_t) ((l.next - l.head) * PAD_POOL_SEGMENT_SIZE - l.head_offset);
+        ledger_unlock(ledger_fd);
+
+        if (available < reserve) {
+            pad_pool_add_segment(dir, ledger_fd, buf);
+            fprintf(verbose, "debug: pad pool holds %lld bytes\n",
+                    (long long) available + (long long) PAD_POOL_SEGMENT_SIZE);
+        } else if (once) {
+            break;
+        } else {
+            sleep(PAD_POOL_POLL_SECONDS);
+        }
+    }
+
+    free(buf);
+    close(ledger_fd);
+}
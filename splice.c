@@ -0,0 +1,86 @@
+#define _GNU_SOURCE    // vmsplice, F_SETPIPE_SZ
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "otp.h"
+
+
+static bool zero_copy_requested;
+
+
+void
+zero_copy_request(void)
+{
+    zero_copy_requested = true;
+}
+
+
+int
+zero_copy_open(FILE *fp, size_t block)
+{
+    struct stat st;
+    if (!zero_copy_requested || fstat(fileno(fp), &st) != 0 || !S_ISFIFO(st.st_mode))
+        return -1;
+
+    // anything stdio still holds has to reach the pipe before the first block
+    if (fflush(fp) != 0)
+        return -1;
+
+    /* The kernel rounds a pipe size up to a power of two pages. Asking for the
+     * largest power of two no larger than a block keeps the capacity within
+     * one block, and as large as the limit allows. */
+    size_t size = ZERO_COPY_MIN_BLOCK;
+    while (size * 2 <= block)
+        size *= 2;
+    int fd = fileno(fp);
+    while (fcntl(fd, F_SETPIPE_SZ, (int) size) < 0 && size > ZERO_COPY_MIN_BLOCK)
+        size /= 2;
+
+    int capacity = fcntl(fd, F_GETPIPE_SZ);
+    if (capacity <= 0 || (size_t) capacity > block) {
+        fprintf(stderr, "warning: unable to bound the output pipe to %zu bytes, "
+                        "writing it through stdio\n", block);
+        return -1;
+    }
+    return fd;
+}
+
+
+bool
+vmsplice_full(int fd, const unsigned char *buf, size_t len)
+{
+    struct iovec iov = {.iov_base = (void *) buf, .iov_len = len};
+    while (iov.iov_len > 0) {
+        ssize_t n = vmsplice(fd, &iov, 1, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        iov.iov_base = (unsigned char *) iov.iov_base + n;
+        iov.iov_len -= (size_t) n;
+    }
+    return true;
+}
+
+
+unsigned char *
+page_alloc(size_t len)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+
+void
+page_free(unsigned char *p, size_t len)
+{
+    if (p != NULL)
+        munmap(p, len);
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "otp.h"
+
+static const char *const stat_stage_names[STAT_STAGE_COUNT] = {
+    "read", "pad", "xor", "write", "io_wait", "crc", "mac"
+};
+
+
+/**
+ * Process-wide statistics, every field is only touched while stats_enabled
+ * is set.
+ */
+static struct {
+    bool enabled;
+    bool completed;
+    const char *mode;
+    struct timespec start;
+    unsigned long long proc_syscr, proc_syscw;
+    atomic_ullong wall_ns[STAT_STAGE_COUNT];
+    atomic_ullong cpu_ns[STAT_STAGE_COUNT];
+    atomic_ullong counters[STAT_COUNTER_COUNT];
+} stats;
+
+
+static unsigned long long
+timespec_ns(struct timespec ts)
+{
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+
+static double
+elapsed_seconds(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (timespec_ns(now) - timespec_ns(start)) / 1e9;
+}
+
+
+/**
+ * Reads the read/write system call counters the kernel keeps in /proc/self/io.
+ * Leaves both at zero where that file is unavailable.
+ */
+static void
+read_proc_io(unsigned long long *syscr, unsigned long long *syscw)
+{
+    *syscr = *syscw = 0;
+
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (fp == NULL)
+        return;
+
+    char key[32];
+    unsigned long long value;
+    while (fscanf(fp, "%31[^:]: %llu\n", key, &value) == 2) {
+        if (strcmp(key, "syscr") == 0)
+            *syscr = value;
+        else if (strcmp(key, "syscw") == 0)
+            *syscw = value;
+    }
+    fclose(fp);
+}
+
+
+/**
+ * atexit() handler, so runs that die on an rdrand failure still report.
+ */
+static void
+stats_atexit(void)
+{
+    stats_print_json(stderr);
+}
+
+
+void
+stats_enable(const char *mode)
+{
+    stats.enabled = true;
+    stats.mode = mode;
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+    read_proc_io(&stats.proc_syscr, &stats.proc_syscw);
+    atexit(stats_atexit);
+}
+
+
+void
+stats_complete(void)
+{
+    stats.completed = true;
+}
+
+
+stat_timer
+stats_start(void)
+{
+    stat_timer t = {0};
+    if (stats.enabled) {
+        clock_gettime(CLOCK_MONOTONIC, &t.wall);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t.cpu);
+    }
+    return t;
+}
+
+
+void
+stats_stop(E_STAT_STAGE stage, stat_timer t)
+{
+    if (!stats.enabled)
+        return;
+
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    atomic_fetch_add_explicit(&stats.wall_ns[stage], timespec_ns(wall) - timespec_ns(t.wall),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.cpu_ns[stage], timespec_ns(cpu) - timespec_ns(t.cpu),
+                              memory_order_relaxed);
+}
+
+
+bool
+stats_active(void)
+{
+    return stats.enabled;
+}
+
+
+void
+stats_add(E_STAT_COUNTER counter, unsigned long long n)
+{
+    if (stats.enabled)
+        atomic_fetch_add_explicit(&stats.counters[counter], n, memory_order_relaxed);
+}
+
+
+void
+stats_print_json(FILE *fp)
+{
+    if (!stats.enabled)
+        return;
+
+    double wall = elapsed_seconds(stats.start);
+    unsigned long long bytes = atomic_load(&stats.counters[STAT_BYTES]);
+    unsigned long long bits = atomic_load(&stats.counters[STAT_PAD_BITS]);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    unsigned long long syscr, syscw;
+    read_proc_io(&syscr, &syscw);
+
+    fprintf(fp, "{\"mode\":\"%s\",\"completed\":%s,\"bytes\":%llu,\"wall_seconds\":%.6f,"
+                "\"cpu_user_seconds\":%.6f,\"cpu_system_seconds\":%.6f,\"throughput_mb_s\":%.3f,"
+                "\"stages\":{",
+            stats.mode, stats.completed ? "true" : "false", bytes, wall,
+            (double) usage.ru_utime.tv_sec + (double) usage.ru_utime.tv_usec / 1e6,
+            (double) usage.ru_stime.tv_sec + (double) usage.ru_stime.tv_usec / 1e6,
+            wall > 0 ? (double) bytes / wall / 1e6 : 0.0);
+
+    for (int s = 0; s < STAT_STAGE_COUNT; ++s)
+        fprintf(fp, "%s\"%s\":{\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f}",
+                s ? "," : "", stat_stage_names[s],
+                (double) atomic_load(&stats.wall_ns[s]) / 1e9,
+                (double) atomic_load(&stats.cpu_ns[s]) / 1e9);
+
+    fprintf(fp, "},\"rdrand\":{\"retries\":%llu,\"failures\":%llu},\"pad_engine\":\"%s\","
+                "\"pad_engine_failovers\":%llu,\"drbg_reseeds\":%llu,"
+                "\"health\":{\"windows\":%llu,\"failures\":%llu,\"ones_fraction\":%.6f},\"pad_pool_bytes\":%llu,"
+                "\"syscalls\":{\"read\":%llu,\"write\":%llu,\"io_uring_enter\":%llu,\"mmap\":%llu}}\n",
+            atomic_load(&stats.counters[STAT_RDRAND_RETRIES]),
+            atomic_load(&stats.counters[STAT_RDRAND_FAILURES]),
+            pad_engine_name(), atomic_load(&stats.counters[STAT_ENGINE_FAILOVERS]),
+            atomic_load(&stats.counters[STAT_DRBG_RESEEDS]),
+            atomic_load(&stats.counters[STAT_HEALTH_WINDOWS]),
+            atomic_load(&stats.counters[STAT_HEALTH_FAILURES]),
+            bits ? (double) atomic_load(&stats.counters[STAT_PAD_ONES]) / (double) bits : 0.0,
+            atomic_load(&stats.counters[STAT_POOL_BYTES]),
+            syscr - stats.proc_syscr, syscw - stats.proc_syscw,
+            atomic_load(&stats.counters[STAT_URING_ENTERS]),
+            atomic_load(&stats.counters[STAT_MMAPS]));
+}
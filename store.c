@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <omp.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+
+#define PAD_STORE_MAGIC "OTPSTOR1"
+#define PAD_EXTENT_MAGIC "OTPX"
+#define PAD_STORE_MIXED_ENGINES 1u  // a failover happened while the pad was generated
+
+
+/**
+ * The header at the start of a pad store, padded to PAD_STORE_DATA_OFFSET.
+ * The pad material follows it.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t data_offset;
+    unsigned char id[PAD_ID_SIZE];
+    uint64_t size;              // bytes of pad material
+    char engine[16];            // pad_engine_name() of the generator, empty in older stores
+    uint32_t engine_flags;      // PAD_STORE_MIXED_ENGINES, 0 in older stores
+} pad_store_header;
+
+
+/**
+ * One record of the allocation log, the range handed to one encryption.
+ * Ranges are allocated in order, so the end of the last record is where
+ * the next allocation starts.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t check;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t time;
+} pad_store_extent;
+
+
+/**
+ * FNV-1a over the fields after \p check, a torn or stale record fails it.
+ */
+static uint32_t
+extent_check(const pad_store_extent *e)
+{
+    const unsigned char *p = (const unsigned char *) &e->offset;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(*e) - offsetof(pad_store_extent, offset); ++i)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+
+static bool
+extent_valid(const pad_store_extent *e)
+{
+    return memcmp(e->magic, PAD_EXTENT_MAGIC, sizeof(e->magic)) == 0 && e->check == extent_check(e);
+}
+
+
+/**
+ * Reads the header of the pad store behind \p fd.
+ * @returns false if \p fd does not start with a pad store header.
+ */
+static bool
+pad_store_read_header(int fd, pad_store_header *h)
+{
+    return pread_full(fd, (unsigned char *) h, sizeof(*h), 0)
+           && memcmp(h->magic, PAD_STORE_MAGIC, sizeof(h->magic)) == 0;
+}
+
+
+void
+pad_store_create(const char *path, off_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        // recreating a store would hand out pad material that was already used
+        fprintf(stderr, "Unable to create the pad store \"%s\": %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    pad_store_header h = {
+        .magic = PAD_STORE_MAGIC, .version = PAD_STORE_VERSION,
+        .data_offset = PAD_STORE_DATA_OFFSET, .size = (uint64_t) size,
+    };
+    const char *first_engine = pad_engine_init();
+    if (!pad_fill(h.id, sizeof(h.id))) {
+        fprintf(stderr, "failed to read from sysrand\n");
+        exit(3);
+    }
+
+    size_t block_size = PAD_BLOCK_SIZE * (size_t) omp_get_max_threads();
+    unsigned char *buf = aligned_alloc(PAD_ALIGNMENT, block_size);
+    if (buf == NULL) {
+        fprintf(stderr, "fatal: unable to allocate the pad buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(buf, 0, PAD_STORE_DATA_OFFSET);
+    memcpy(buf, &h, sizeof(h));
+    if (!pwrite_full(fd, buf, PAD_STORE_DATA_OFFSET, 0)) {
+        fprintf(stderr, "fatal: write error while creating the pad store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (off_t done = 0; done < size;) {
+        size_t len = size - done < (off_t) block_size ? (size_t) (size - done) : block_size;
+        long chunks = (long) ((len + PAD_BLOCK_SIZE - 1) / PAD_BLOCK_SIZE);
+        int failed = 0;
+
+        #pragma omp parallel for schedule(static) reduction(|:failed)
+        for (long c = 0; c < chunks; ++c) {
+            size_t offset = (size_t) c * PAD_BLOCK_SIZE;
+            size_t chunk = len - offset < PAD_BLOCK_SIZE ? len - offset : PAD_BLOCK_SIZE;
+            if (!pad_fill(buf + offset, chunk))
+                failed = 1;
+        }
+        if (failed) {
+            fprintf(stderr, "failed to read from sysrand\n");
+            exit(3);
+        }
+
+        if (!pwrite_full(fd, buf, len, PAD_STORE_DATA_OFFSET + done)) {
+            fprintf(stderr, "fatal: write error while creating the pad store\n");
+            exit(EXIT_FAILURE);
+        }
+        done += (off_t) len;
+    }
+
+    // the header names the engine that finished the pad, a failover may have replaced the first
+    const char *engine = pad_engine_name();
+    strncpy(h.engine, engine, sizeof(h.engine) - 1);
+    if (strcmp(engine, first_engine) != 0)
+        h.engine_flags |= PAD_STORE_MIXED_ENGINES;
+    if (!pwrite_full(fd, (const unsigned char *) &h, sizeof(h), 0)) {
+        fprintf(stderr, "fatal: write error while creating the pad store\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fsync(fd) != 0) {
+        fprintf(stderr, "fatal: unable to flush the pad store\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(buf);
+
+    // a fresh store starts with an empty allocation log
+    char *log_name = concat(path, PAD_STORE_LOG_SUFFIX);
+    fd = open(log_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || fsync(fd) != 0) {
+        fprintf(stderr, "Unable to create the allocation log \"%s\"\n", log_name);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(log_name);
+}
+
+
+/**
+ * Hands out the next \p len bytes of the store and records them in its
+ * allocation log. The record is durable before the caller sees the offset,
+ * so a range is never handed out twice, even across crashes.
+ * @returns The offset of the range within the pad material.
+ */
+static uint64_t
+pad_store_allocate(const char *path, uint64_t store_size, uint64_t len)
+{
+    char *log_name = concat(path, PAD_STORE_LOG_SUFFIX);
+    int fd = open(log_name, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open the allocation log \"%s\"\n", log_name);
+        exit(EXIT_FAILURE);
+    }
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "fatal: unable to lock \"%s\"\n", log_name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // only a record cut short by a crash can be invalid, and it was never used
+    struct stat st;
+    fstat(fd, &st);
+    off_t n = st.st_size / (off_t) sizeof(pad_store_extent);
+    pad_store_extent last = {0};
+    for (; n > 0; --n) {
+        if (!pread_full(fd, (unsigned char *) &last, sizeof(last),
+                        (n - 1) * (off_t) sizeof(pad_store_extent))) {
+            fprintf(stderr, "fatal: unable to read \"%s\"\n", log_name);
+            exit(EXIT_FAILURE);
+        }
+        if (extent_valid(&last))
+            break;
+    }
+    uint64_t next = n > 0 ? last.offset + last.length : 0;
+    off_t end = n * (off_t) sizeof(pad_store_extent);
+
+    if (next + len > store_size) {
+        fprintf(stderr, "fatal: the pad store has %llu of the %llu bytes needed left\n",
+                (unsigned long long) (store_size - next), (unsigned long long) len);
+        exit(EXIT_FAILURE);
+    }
+
+    pad_store_extent e = {
+        .magic = PAD_EXTENT_MAGIC, .offset = next, .length = len, .time = (uint64_t) time(NULL),
+    };
+    e.check = extent_check(&e);
+    if ((end != st.st_size && ftruncate(fd, end) != 0)
+        || !pwrite_full(fd, (const unsigned char *) &e, sizeof(e), end) || fdatasync(fd) != 0) {
+        fprintf(stderr, "fatal: unable to update \"%s\"\n", log_name);
+        exit(EXIT_FAILURE);
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    free(log_name);
+    return next;
+}
+
+
+void
+encrypt_store(FILE *plain_text, const char *output_name, const char *store_path)
+{
+    // the header names the range before the cipher text, so the length has to be known
+    struct stat st;
+    if (fstat(fileno(plain_text), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "--pad-store needs the plain text to be a regular file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0)
+        invalid_file_size("plain text");
+
+    int pad_fd = open(store_path, O_RDONLY);
+    pad_store_header store;
+    if (pad_fd < 0 || !pad_store_read_header(pad_fd, &store)) {
+        fprintf(stderr, "\"%s\" is not a pad store\n", store_path);
+        exit(EXIT_FAILURE);
+    }
+
+    // the output is opened only once the range is taken, a full store leaves no empty file behind
+    uint64_t offset = pad_store_allocate(store_path, store.size, (uint64_t) st.st_size);
+    FILE *output = strcmp(output_name, "-") == 0 ? stdout : fopen(output_name, "wb");
+    if (output == NULL) {
+        fprintf(stderr, "Unable to open \"%s\" in write-binary\n", output_name);
+        exit(EXIT_FAILURE);
+    }
+
+    container_encrypt(plain_text, output, pad_fd, store.id, offset, (uint64_t) st.st_size);
+    close(pad_fd);
+    fclose(output);
+}
+
+
+bool
+is_pad_store(FILE *otp)
+{
+    pad_store_header h;
+    return pad_store_read_header(fileno(otp), &h);
+}
+
+
+/**
+ * Reads the header of the pad store \p otp, exiting if it is none.
+ */
+static pad_store_header
+pad_store_open(FILE *otp)
+{
+    pad_store_header store;
+    if (!pad_store_read_header(fileno(otp), &store)) {
+        fprintf(stderr, "fatal: the one-time-pad is not a pad store\n");
+        exit(EXIT_FAILURE);
+    }
+    return store;
+}
+
+
+void
+decrypt_store(FILE *cipher_text, FILE *output, FILE *otp)
+{
+    pad_store_header store = pad_store_open(otp);
+    container_decrypt(cipher_text, output, fileno(otp), store.id, store.size);
+}
+
+
+void
+decrypt_store_range(FILE *cipher_text, FILE *output, FILE *otp, uint64_t offset, uint64_t len)
+{
+    struct stat st;
+    if (fstat(fileno(cipher_text), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "--range needs the cipher text to be a regular file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pad_store_header store = pad_store_open(otp);
+    container_decrypt_range(cipher_text, output, fileno(otp), store.id, store.size, offset, len);
+}
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE    // O_DIRECT, fallocate, sync_file_range
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "otp.h"
+
+
+static bool direct_io_requested;
+static bool drop_cache_requested;
+
+
+void
+direct_io_request(void)
+{
+    direct_io_requested = true;
+}
+
+
+void
+drop_cache_request(void)
+{
+    drop_cache_requested = true;
+}
+
+
+size_t
+output_buffer_alignment(void)
+{
+    return direct_io_requested ? DIRECT_IO_ALIGNMENT : PAD_ALIGNMENT;
+}
+
+
+void
+output_open(output_writer *w, FILE *fp, off_t size)
+{
+    *w = (output_writer) {.fp = fp, .fd = -1};
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    off_t offset = ftello(fp);
+    if (fflush(fp) != 0 || offset < 0)
+        return;
+
+    /* Reserving the whole output up front lets the file system lay it out in
+     * a few large extents instead of growing it block by block. The size is
+     * kept, so an encryption that stops early leaves no zeros behind, and a
+     * file system without fallocate() just grows the file as before. */
+    if (size > 0)
+        fallocate(fileno(fp), FALLOC_FL_KEEP_SIZE, offset, size);
+
+    if (!direct_io_requested && !drop_cache_requested)
+        return;
+    w->fd = fileno(fp);
+    w->offset = w->dropped = offset;
+    w->flags = fcntl(w->fd, F_GETFL);
+    w->direct_ok = direct_io_requested && w->flags >= 0;
+}
+
+
+/**
+ * Turns O_DIRECT on or off for the next write. A file system that refuses it
+ * is written through the page cache from then on.
+ */
+static void
+output_set_direct(output_writer *w, bool direct)
+{
+    if (!w->direct_ok || w->direct == direct)
+        return;
+    if (fcntl(w->fd, F_SETFL, direct ? w->flags | O_DIRECT : w->flags) != 0) {
+        w->direct_ok = false;
+        return;
+    }
+    w->direct = direct;
+}
+
+
+/**
+ * Evicts everything written before the last block from the page cache. That
+ * block was handed to writeback when it was written, so by now it is usually
+ * on disk and waiting for it costs little.
+ */
+static void
+output_drop(output_writer *w, off_t end)
+{
+    if (!drop_cache_requested || end <= w->dropped)
+        return;
+    sync_file_range(w->fd, w->dropped, end - w->dropped,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(w->fd, w->dropped, end - w->dropped, POSIX_FADV_DONTNEED);
+    w->dropped = end;
+}
+
+
+bool
+output_write(output_writer *w, const unsigned char *buf, size_t len)
+{
+    if (w->fd < 0)
+        return fwrite(buf, sizeof(char), len, w->fp) == len;
+
+    // O_DIRECT takes whole aligned blocks, the tail of the output goes through the cache
+    off_t start = w->offset;
+    size_t head = 0;
+    if (w->direct_ok && w->offset % DIRECT_IO_ALIGNMENT == 0
+        && (uintptr_t) buf % DIRECT_IO_ALIGNMENT == 0)
+        head = len - len % DIRECT_IO_ALIGNMENT;
+
+    if (head > 0) {
+        output_set_direct(w, true);
+        if (w->direct) {
+            if (!pwrite_full(w->fd, buf, head, w->offset))
+                return false;
+            buf += head;
+            len -= head;
+            w->offset += (off_t) head;
+        }
+    }
+    if (len > 0) {
+        output_set_direct(w, false);
+        if (!pwrite_full(w->fd, buf, len, w->offset))
+            return false;
+        if (drop_cache_requested)
+            sync_file_range(w->fd, w->offset, (off_t) len, SYNC_FILE_RANGE_WRITE);
+    }
+
+    w->offset += (off_t) len;
+    output_drop(w, start);
+    return true;
+}
+
+
+bool
+output_close(output_writer *w)
+{
+    if (w->fd < 0)
+        return true;
+
+    output_drop(w, w->offset);
+    output_set_direct(w, false);
+
+    // stdio continues where the writes ended, e.g. with the MAC tag
+    return fseeko(w->fp, w->offset, SEEK_SET) == 0;
+}
+
+
+void
+input_advise(FILE *fp)
+{
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+
+void
+input_drop(FILE *fp, off_t offset, size_t len)
+{
+    if (drop_cache_requested)
+        posix_fadvise(fileno(fp), offset, (off_t) len, POSIX_FADV_DONTNEED);
+}
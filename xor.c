@@ -0,0 +1,119 @@
+#include <stdbool.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "otp.h"
+
+
+/**
+ * Baseline kernel, SSE2 is part of x86-64 so this one always works.
+ */
+static void
+xor_buffer_sse2(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        for (size_t j = 0; j < 64; j += 16)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *) (a + i + j));
+            __m128i y = _mm_loadu_si128((const __m128i *) (b + i + j));
+            _mm_storeu_si128((__m128i *) (dst + i + j), _mm_xor_si128(x, y));
+        }
+    }
+
+    for (; i + ULL_SIZE <= len; i += ULL_SIZE)
+    {
+        unsigned long long x, y;
+        memcpy(&x, a + i, ULL_SIZE);
+        memcpy(&y, b + i, ULL_SIZE);
+        x ^= y;
+        memcpy(dst + i, &x, ULL_SIZE);
+    }
+
+    for (; i < len; ++i)
+        dst[i] = a[i] ^ b[i];
+}
+
+
+__attribute__((target("avx2"))) static void
+xor_buffer_avx2(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128)
+    {
+        for (size_t j = 0; j < 128; j += 32)
+        {
+            __m256i x = _mm256_loadu_si256((const __m256i *) (a + i + j));
+            __m256i y = _mm256_loadu_si256((const __m256i *) (b + i + j));
+            _mm256_storeu_si256((__m256i *) (dst + i + j), _mm256_xor_si256(x, y));
+        }
+    }
+
+    xor_buffer_sse2(dst + i, a + i, b + i, len - i);
+}
+
+
+__attribute__((target("avx512f"))) static void
+xor_buffer_avx512(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + 256 <= len; i += 256)
+    {
+        for (size_t j = 0; j < 256; j += 64)
+        {
+            __m512i x = _mm512_loadu_si512(a + i + j);
+            __m512i y = _mm512_loadu_si512(b + i + j);
+            _mm512_storeu_si512(dst + i + j, _mm512_xor_si512(x, y));
+        }
+    }
+
+    xor_buffer_sse2(dst + i, a + i, b + i, len - i);
+}
+
+
+static bool
+cpu_has_avx512f(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+
+
+static bool
+cpu_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+
+const xor_kernel_info xor_kernels[] = {
+    {"AVX-512", cpu_has_avx512f, xor_buffer_avx512},
+    {"AVX2", cpu_has_avx2, xor_buffer_avx2},
+    {"SSE2", NULL, xor_buffer_sse2},
+};
+const size_t xor_kernel_count = sizeof(xor_kernels) / sizeof(xor_kernels[0]);
+
+
+static xor_fn xor_kernel = xor_buffer_sse2;
+
+
+const char *
+xor_init(void)
+{
+    // the table is ordered widest first and always ends with a baseline kernel
+    size_t i = 0;
+    while (xor_kernels[i].supported != NULL && !xor_kernels[i].supported())
+        ++i;
+
+    xor_kernel = xor_kernels[i].fn;
+    return xor_kernels[i].name;
+}
+
+
+void
+xor_buffer(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t len)
+{
+    xor_kernel(dst, a, b, len);
+}